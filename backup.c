@@ -0,0 +1,314 @@
+// backup.c: incremental backups from the changed-block tracking sidecar
+//
+//   backup -f <image> -o <delta>   write every block changed since the last
+//                                  backup to delta (all of them the first
+//                                  time), then start a new epoch
+//   backup -f <image> -a <delta>   bring a backup image forward by applying
+//                                  a delta; a full one creates the image
+//
+// The engine keeps <image>.cbt current while the image is mounted (see
+// "Changed-block tracking" in filemgr2.c); MFS_CBT=1 creates it. Either side
+// may be "-" for stdout or stdin, to pipe deltas between hosts. A delta is a
+// delta_file_t, then runs of consecutive blocks, each a delta_run_t and its
+// blocks, ending with a run of no blocks.
+//
+// The tool takes an exclusive lock on the sidecar, so it refuses an image
+// that is mounted. After an apply, the backup's own sidecar is at the
+// delta's epoch with no bits set; a backup that was changed since it last
+// applied a delta is refused rather than silently diverging.
+//
+// Exit status: 0 success, 1 usage, 2 the delta does not fit the image, 4 I/O error.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "ufs.h"
+
+#define DELTA_MAGIC (0x4d465342)
+#define RUN_MAX (256)   // blocks per run, and per read or write
+
+typedef struct {
+    unsigned int magic;
+    int nblocks;             // image size in blocks
+    unsigned long from;      // epoch the backup must be at (0: a full image)
+    unsigned long to;        // epoch it is at afterwards
+} delta_file_t;
+
+typedef struct {
+    int start;               // first block
+    int count;               // 0 ends the delta
+} delta_run_t;
+
+static char run_buffer[RUN_MAX * UFS_BLOCK_SIZE];
+
+void usage() {
+    fprintf(stderr, "usage: backup -f <image_file> (-o <delta> | -a <delta>)\n");
+    exit(1);
+}
+
+static void fail(const char *what) {
+    perror(what);
+    exit(4);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_all(int fd, const void *buffer, size_t len) {
+    const char *p = buffer;
+    while (len > 0) {
+        ssize_t rc = write(fd, p, len);
+        if (rc <= 0) {
+            fail("write delta");
+        }
+        p += rc;
+        len -= rc;
+    }
+}
+
+static void read_all(int fd, void *buffer, size_t len) {
+    char *p = buffer;
+    while (len > 0) {
+        ssize_t rc = read(fd, p, len);
+        if (rc < 0) {
+            fail("read delta");
+        }
+        if (rc == 0) {
+            fprintf(stderr, "delta is truncated\n");
+            exit(2);
+        }
+        p += rc;
+        len -= rc;
+    }
+}
+
+static size_t sidecar_len(int nblocks) {
+    return UFS_BLOCK_SIZE + (size_t) (nblocks + 31) / 32 * sizeof(unsigned int);
+}
+
+// Opens and locks <image>.cbt; returns its descriptor
+static int open_sidecar(char *image_file, int flags) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.cbt", image_file);
+    int fd = open(path, flags, 0644);
+    if (fd < 0) {
+        fail(path);
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "%s: image is mounted or being backed up\n", path);
+        exit(4);
+    }
+    return fd;
+}
+
+// Image size in blocks, as its superblock describes it
+static int image_blocks(int fd) {
+    super_t sb;
+    if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+        fail("read superblock");
+    }
+    long nblocks = (long) sb.data_region_addr + sb.data_region_len;
+    if (sb.data_region_addr <= 0 || sb.data_region_len <= 0 || nblocks > INT_MAX) {
+        fprintf(stderr, "bad superblock\n");
+        exit(2);
+    }
+    return nblocks;
+}
+
+static int take_backup(char *image_file, char *delta_file) {
+    int fd = open(image_file, O_RDONLY);
+    if (fd < 0) {
+        fail(image_file);
+    }
+    int nblocks = image_blocks(fd);
+    int cfd = open_sidecar(image_file, O_RDWR);
+    size_t len = sidecar_len(nblocks);
+    struct stat st;
+    if (fstat(cfd, &st) != 0 || st.st_size != (off_t) len) {
+        fprintf(stderr, "%s.cbt does not match the image\n", image_file);
+        exit(2);
+    }
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, cfd, 0);
+    if (map == MAP_FAILED) {
+        fail("mmap");
+    }
+    cbt_header_t *h = (cbt_header_t *) map;
+    unsigned int *bits = (unsigned int *) (map + UFS_BLOCK_SIZE);
+    if (h->magic != UFS_CBT_MAGIC || h->nblocks != nblocks) {
+        fprintf(stderr, "%s.cbt does not match the image\n", image_file);
+        exit(2);
+    }
+
+    int out = strcmp(delta_file, "-") == 0 ? 1 : open(delta_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        fail(delta_file);
+    }
+    double start = now();
+    delta_file_t hdr = { DELTA_MAGIC, nblocks, h->epoch, h->epoch + 1 };
+    write_all(out, &hdr, sizeof(hdr));
+    long changed = 0;
+    for (int b = 0; b < nblocks; ) {
+        if (bits[b / 32] == 0) {
+            b += 32 - b % 32;
+            continue;
+        }
+        if (!(bits[b / 32] & (0x1u << (31 - b % 32)))) {
+            b++;
+            continue;
+        }
+        delta_run_t run = { b, 0 };
+        while (b < nblocks && run.count < RUN_MAX && (bits[b / 32] & (0x1u << (31 - b % 32)))) {
+            run.count++;
+            b++;
+        }
+        size_t bytes = (size_t) run.count * UFS_BLOCK_SIZE;
+        if (pread(fd, run_buffer, bytes, (off_t) run.start * UFS_BLOCK_SIZE) != (ssize_t) bytes) {
+            fail("read image");
+        }
+        write_all(out, &run, sizeof(run));
+        write_all(out, run_buffer, bytes);
+        changed += run.count;
+    }
+    delta_run_t end = { 0, 0 };
+    write_all(out, &end, sizeof(end));
+    if (out != 1 && (fsync(out) != 0 || close(out) != 0)) {
+        fail(delta_file);
+    }
+
+    // New epoch first: a crash before the bits are cleared only makes the
+    // next delta larger than it has to be
+    h->epoch++;
+    if (msync(map, UFS_BLOCK_SIZE, MS_SYNC) != 0) {
+        fail("msync");
+    }
+    memset(bits, 0, len - UFS_BLOCK_SIZE);
+    if (msync(map, len, MS_SYNC) != 0) {
+        fail("msync");
+    }
+    fprintf(stderr, "epoch %lu: %ld of %d blocks changed, %.1f MB in %.3f s\n", hdr.to, changed, nblocks,
+            changed * (double) UFS_BLOCK_SIZE / 1e6, now() - start);
+    munmap(map, len);
+    close(cfd);
+    close(fd);
+    return 0;
+}
+
+static int apply_backup(char *image_file, char *delta_file) {
+    int in = strcmp(delta_file, "-") == 0 ? 0 : open(delta_file, O_RDONLY);
+    if (in < 0) {
+        fail(delta_file);
+    }
+    delta_file_t hdr;
+    read_all(in, &hdr, sizeof(hdr));
+    if (hdr.magic != DELTA_MAGIC || hdr.nblocks <= 0 || hdr.to != hdr.from + 1) {
+        fprintf(stderr, "%s is not a delta\n", delta_file);
+        exit(2);
+    }
+
+    int full = (hdr.from == 0);
+    int fd = open(image_file, O_RDWR | (full ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        fail(image_file);
+    }
+    int cfd = open_sidecar(image_file, O_RDWR | (full ? O_CREAT : 0));
+    size_t len = sidecar_len(hdr.nblocks);
+    if (!full) {
+        // The backup must be exactly where the delta starts, and unchanged
+        struct stat st;
+        char *map;
+        if (fstat(cfd, &st) != 0 || st.st_size != (off_t) len ||
+            (map = mmap(NULL, len, PROT_READ, MAP_SHARED, cfd, 0)) == MAP_FAILED) {
+            fprintf(stderr, "%s.cbt does not match the delta\n", image_file);
+            exit(2);
+        }
+        cbt_header_t *h = (cbt_header_t *) map;
+        if (h->magic != UFS_CBT_MAGIC || h->nblocks != hdr.nblocks || h->epoch != hdr.from) {
+            fprintf(stderr, "backup is at epoch %lu, delta goes from %lu to %lu\n",
+                    h->magic == UFS_CBT_MAGIC ? h->epoch : 0, hdr.from, hdr.to);
+            exit(2);
+        }
+        unsigned int *bits = (unsigned int *) (map + UFS_BLOCK_SIZE);
+        for (size_t w = 0; w < (len - UFS_BLOCK_SIZE) / sizeof(unsigned int); w++) {
+            if (bits[w] != 0) {
+                fprintf(stderr, "backup was changed since epoch %lu\n", hdr.from);
+                exit(2);
+            }
+        }
+        munmap(map, len);
+    } else if (ftruncate(fd, (off_t) hdr.nblocks * UFS_BLOCK_SIZE) != 0) {
+        fail(image_file);
+    }
+
+    double start = now();
+    long applied = 0;
+    for (;;) {
+        delta_run_t run;
+        read_all(in, &run, sizeof(run));
+        if (run.count == 0) {
+            break;
+        }
+        if (run.start < 0 || run.count < 0 || run.count > RUN_MAX || run.start > hdr.nblocks - run.count) {
+            fprintf(stderr, "delta has a run outside the image\n");
+            exit(2);
+        }
+        size_t bytes = (size_t) run.count * UFS_BLOCK_SIZE;
+        read_all(in, run_buffer, bytes);
+        if (pwrite(fd, run_buffer, bytes, (off_t) run.start * UFS_BLOCK_SIZE) != (ssize_t) bytes) {
+            fail("write image");
+        }
+        applied += run.count;
+    }
+    if (fsync(fd) != 0) {
+        fail("fsync");
+    }
+
+    // The backup now matches the source at epoch hdr.to, with no changes since
+    cbt_header_t h = { UFS_CBT_MAGIC, hdr.nblocks, hdr.to };
+    if (ftruncate(cfd, 0) != 0 || ftruncate(cfd, len) != 0 ||
+        pwrite(cfd, &h, sizeof(h), 0) != sizeof(h) || fsync(cfd) != 0) {
+        fail("write sidecar");
+    }
+    fprintf(stderr, "epoch %lu: %ld blocks applied in %.3f s\n", hdr.to, applied, now() - start);
+    close(cfd);
+    close(fd);
+    if (in != 0) {
+        close(in);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    char *image_file = NULL, *out_file = NULL, *in_file = NULL;
+
+    while ((ch = getopt(argc, argv, "f:o:a:")) != -1) {
+        switch (ch) {
+        case 'f':
+            image_file = optarg;
+            break;
+        case 'o':
+            out_file = optarg;
+            break;
+        case 'a':
+            in_file = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (image_file == NULL || (out_file == NULL) == (in_file == NULL)) {
+        usage();
+    }
+    return out_file != NULL ? take_backup(image_file, out_file) : apply_backup(image_file, in_file);
+}
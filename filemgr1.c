@@ -249,7 +249,7 @@ int MFS_Shutdown() {
 }
 
 int read_inode(int inode_num, inode_t *inode) {
-    int inode_offset = sb.inode_region_addr * UFS_BLOCK_SIZE + sizeof(inode_t) * inode_num;
+    off_t inode_offset = (off_t) sb.inode_region_addr * UFS_BLOCK_SIZE + (off_t) sizeof(inode_t) * inode_num;
     if (pread(disk_fd, inode, sizeof(inode_t), inode_offset) != sizeof(inode_t)) {
         return -1;
     }
@@ -257,7 +257,7 @@ int read_inode(int inode_num, inode_t *inode) {
 }
 
 int write_inode(int inode_num, inode_t *inode) {
-    int inode_offset = sb.inode_region_addr * UFS_BLOCK_SIZE + sizeof(inode_t) * inode_num;
+    off_t inode_offset = (off_t) sb.inode_region_addr * UFS_BLOCK_SIZE + (off_t) sizeof(inode_t) * inode_num;
     if (pwrite(disk_fd, inode, sizeof(inode_t), inode_offset) != sizeof(inode_t)) {
         return -1;
     }
@@ -265,7 +265,7 @@ int write_inode(int inode_num, inode_t *inode) {
 }
 
 int read_block(int block_num, void *buffer) {
-    int block_offset = block_num * UFS_BLOCK_SIZE;
+    off_t block_offset = (off_t) block_num * UFS_BLOCK_SIZE;
     if (pread(disk_fd, buffer, UFS_BLOCK_SIZE, block_offset) != UFS_BLOCK_SIZE) {
         return -1;
     }
@@ -273,7 +273,7 @@ int read_block(int block_num, void *buffer) {
 }
 
 int write_block(int block_num, void *buffer) {
-    int block_offset = block_num * UFS_BLOCK_SIZE;
+    off_t block_offset = (off_t) block_num * UFS_BLOCK_SIZE;
     if (pwrite(disk_fd, buffer, UFS_BLOCK_SIZE, block_offset) != UFS_BLOCK_SIZE) {
         return -1;
     }
@@ -1,534 +1,3684 @@
 // mfs.c
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/types.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <errno.h>
 #include "mfs.h"
 #include "ufs.h"
 #include <assert.h>
 
-static int fs_fd = -1;
-static super_t superblock;
-static char *fs_image_path;
+// ---------------------------------------------------------------------------
+// Volumes
+//
+// Everything the engine knows about one image lives in a volume_t, so one
+// process can serve several images at once. Each thread works on one volume
+// at a time, selected with MFS_Use (MFS_Init mounts an image and selects it),
+// and the engine reaches it through the thread-local vol. Any number of
+// threads may use the same volume; see "Locking" below. A volume counts the
+// threads that have it selected and cannot be unmounted while any other
+// thread does, since such a thread may be inside a call on it.
+// ---------------------------------------------------------------------------
 
-int read_block(int block_num, void *buffer) {
-    return pread(fs_fd, buffer, UFS_BLOCK_SIZE, block_num * UFS_BLOCK_SIZE);
+#define ENTRIES_PER_BLOCK ((int) (UFS_BLOCK_SIZE / sizeof(dir_ent_t)))
+#define INODES_PER_BLOCK ((int) (UFS_BLOCK_SIZE / sizeof(inode_t)))
+#define BITS_PER_BLOCK (UFS_BLOCK_SIZE * 8)
+#define GROUP_WORDS (64)           // bitmap words summarized by one group count
+#define GROUP_BITS (GROUP_WORDS * 32)
+#define GROUPS_PER_BLOCK (BITS_PER_BLOCK / GROUP_BITS)
+
+typedef struct {
+    int addr;               // first bitmap block on disk
+    int len;                // in blocks
+    int num_bits;
+    unsigned int *words;    // in-memory copy
+    int *block_free;        // clear bits in each bitmap block
+    int *group_free;        // clear bits in each GROUP_WORDS-word group
+    long *gauge;            // free_inodes or free_blocks
+} bitmap_t;
+
+typedef struct name_node {
+    int pinum;
+    int inum;
+    char name[28];
+    struct name_node *next;
+} name_node_t;
+
+// Slot bookkeeping for one directory; see "Directory slots" below
+#define DIR_SLOTS (DIRECT_PTRS * ENTRIES_PER_BLOCK)
+
+typedef struct {
+    unsigned int used[DIR_SLOTS / 32];  // same bit order as the bitmaps
+    int block_free[DIRECT_PTRS];        // free slots per block, -1 if unallocated
+    int live;
+} dir_slots_t;
+
+// A byte range of the image written by the current op; commit() ships these
+// to a replicator, and an op with none has nothing to commit
+typedef struct {
+    off_t start;
+    off_t end;
+} range_t;
+
+// One committing op waiting on the volume's flusher
+typedef struct commit_req {
+    int done;
+    int rc;
+    struct commit_req *next;
+} commit_req_t;
+
+// A read lease one holder has on one inode
+typedef struct lease {
+    int holder;
+    int inum;
+    unsigned long expires;      // now_ns() deadline
+    struct lease *next;
+} lease_t;
+
+typedef struct volume {
+    int id;
+    int fd;
+    char *image_path;
+    char *map;                  // read-only view of the whole image, or NULL
+    size_t map_len;
+    super_t superblock;
+    long free_inodes;           // free-space gauges, kept current by set_bitmap()
+    long free_blocks;
+    char *metadata;             // blocks 1 .. data_region_addr - 1
+    bitmap_t inode_map;
+    bitmap_t data_map;
+    inode_t *inode_table;
+    name_node_t **name_index;
+    unsigned int name_index_mask;
+    int *parent_of;             // -1 for free inodes and the root
+    int *child_block;           // first inode of the block a directory's new
+                                // entries go to, -1 until one is picked
+    int next_index_chunk;
+    lease_t **leases;           // by inode number, NULL until first lease
+    MFS_Recall_t recall;
+    void *recall_arg;
+    MFS_Replicate_t replicate;  // primary: where committed deltas go
+    void *replicate_arg;
+    unsigned long seq;          // last delta sent (primary) or applied (replica)
+    unsigned long stream;       // the numbering seq belongs to, 0 for none
+    int read_only;              // a replica until promoted
+    unsigned long applied_ns;   // replica: when the last delta was applied...
+    unsigned long committed_ns; // ...and when the primary committed it
+    dir_slots_t **dir_slot_cache;   // by inode number, NULL until needed
+    int defrag_next;            // inode the next MFS_Defrag call starts at
+    int cbt_fd;                 // changed-block sidecar, or -1
+    char *cbt_map;              // all of it, shared
+    size_t cbt_len;
+    int cbt_unsynced;           // bits set since the last sidecar sync that worked
+    pthread_mutex_t flush_lock;     // protects the fields below
+    pthread_cond_t flush_wake;      // work for the flusher
+    pthread_cond_t flush_done;      // a batch became durable
+    commit_req_t *flush_queue;
+    int flush_stop;
+    int flusher_running;
+    pthread_t flusher;
+    pthread_rwlock_t lock;      // see "Locking"
+    int users;                  // threads that have it selected, under volumes_lock
+} volume_t;
+
+#define MAX_VOLUMES (64)
+
+static volume_t *volumes[MAX_VOLUMES];
+static pthread_mutex_t volumes_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread volume_t *vol;
+static pthread_key_t vol_key;      // drops a thread's selection when it exits
+
+int get_inode(int inum, inode_t *inode);
+int put_inode(int inum, inode_t *inode);
+int free_inode(int inum);
+static int commit(void);
+
+// ---------------------------------------------------------------------------
+// Locking
+//
+// Lookups, stats and reads hold their volume's lock shared, so they run in
+// parallel; anything that changes the volume, its leases or its settings
+// holds it alone, writers first so a stream of reads cannot starve them.
+// Per-op state (dirty ranges, delta events, counters, trace rings) is
+// thread-local, so a change can drop the lock before waiting for its
+// commit: other threads go on meanwhile, and commits that overlap share
+// one fdatasync in the flusher. A reader can thus see a change a moment
+// before it is durable. With a replicator set, the commit stays under the
+// lock so deltas are numbered in the order the changes were made. The
+// replicator callback runs under the lock and must not call back in; recall
+// callbacks run on threads of their own while the change waits without it.
+// ---------------------------------------------------------------------------
+
+static void lock_init(volume_t *v) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&v->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
 }
 
-int write_block(int block_num, void *buffer) {
-    return pwrite(fs_fd, buffer, UFS_BLOCK_SIZE, block_num * UFS_BLOCK_SIZE);
+static void lock_shared(void) {
+    if (vol != NULL) {
+        pthread_rwlock_rdlock(&vol->lock);
+    }
 }
 
-int MFS_Init(char *filename, int port) {
-    // For local filesystem, we ignore the port parameter
-    fs_image_path = strdup(filename);
-    fs_fd = open(fs_image_path, O_RDWR);
-    if (fs_fd < 0) {
-        perror("Unable to open filesystem image");
+static void lock_exclusive(void) {
+    if (vol != NULL) {
+        pthread_rwlock_wrlock(&vol->lock);
+    }
+}
+
+static void unlock_volume(void) {
+    if (vol != NULL) {
+        pthread_rwlock_unlock(&vol->lock);
+    }
+}
+
+// Ends a change: unlocks and commits it, in that order unless deltas are
+// being sent. The thread keeps the volume selected meanwhile, so it cannot
+// be unmounted under the commit.
+static int unlock_commit(void) {
+    if (vol == NULL) {
         return -1;
     }
+    if (vol->replicate != NULL) {
+        int rc = commit();
+        unlock_volume();
+        return rc;
+    }
+    unlock_volume();
+    return commit();
 }
 
-int MFS_Lookup(int pinum, char *name) {
+// ---------------------------------------------------------------------------
+// Metrics
+//
+// Every thread that calls into the engine gets its own counter block, so the
+// hot path only ever touches thread-local memory. Blocks are linked onto a
+// global list the first time a thread shows up (the only place a lock is
+// taken) and are summed when someone asks for a report. Counters are written
+// with relaxed atomic stores so a concurrent reader never sees a torn value.
+// ---------------------------------------------------------------------------
 
-    // Read the parent inode
-    inode_t parent_inode;
-    int inode_block = superblock.inode_region_addr + (pinum / (UFS_BLOCK_SIZE / sizeof(inode_t)));
-    int inode_offset = (pinum % (UFS_BLOCK_SIZE / sizeof(inode_t))) * sizeof(inode_t);
-    
-    if (pread(fs_fd, &parent_inode, sizeof(inode_t), inode_block * UFS_BLOCK_SIZE + inode_offset) != sizeof(inode_t)) {
-        return -2;
+enum {
+    OP_LOOKUP,
+    OP_STAT,
+    OP_WRITE,
+    OP_READ,
+    OP_CREAT,
+    OP_UNLINK,
+    OP_SHUTDOWN,
+    OP_REMOVETREE,
+    OP_COPY,
+    OP_APPLY,
+    OP_DEFRAG,
+    NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = {
+    "lookup", "stat", "write", "read", "creat", "unlink", "shutdown", "removetree", "copy", "apply", "defrag"
+};
+
+#define LAT_BUCKETS (40)   // bucket b holds latencies in [2^(b-1), 2^b) ns
+
+typedef struct thread_stats {
+    unsigned long op_count[NUM_OPS];
+    unsigned long op_errors[NUM_OPS];
+    unsigned long op_ns[NUM_OPS];
+    unsigned long op_lat[NUM_OPS][LAT_BUCKETS];
+    unsigned long preads;
+    unsigned long pwrites;
+    unsigned long fsyncs;
+    unsigned long commit_ns[NUM_OPS];
+    unsigned long commit_lat[NUM_OPS][LAT_BUCKETS];
+    unsigned long group_commits;    // ops made durable by the flusher, over fsyncs
+    unsigned long cbt_syncs;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long inode_allocs;
+    unsigned long inode_frees;
+    unsigned long block_allocs;
+    unsigned long block_frees;
+    unsigned long bits_scanned;
+    unsigned long copy_ranges;
+    unsigned long bytes_mapped;     // handed out by MFS_ReadMap without a copy
+    unsigned long leases_granted;
+    unsigned long leases_recalled;
+    unsigned long deltas_sent;
+    unsigned long deltas_applied;
+    unsigned long deltas_lost;      // changes a primary could not encode or send
+    unsigned long delta_bytes;
+    unsigned long defrag_files;
+    unsigned long defrag_blocks;
+    struct thread_stats *next;
+} thread_stats_t;
+
+static __thread thread_stats_t *my_stats;
+static thread_stats_t *all_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Startup phase timings (ms) of the most recent MFS_Mount
+static struct {
+    double superblock;
+    double metadata;
+    double summaries;
+    double dir_index;
+    double warm;        // wall time of the parallel phase
+    double total;
+    int threads;
+} startup;
+
+static thread_stats_t *thread_stats(void) {
+    if (my_stats == NULL) {
+        thread_stats_t *ts = calloc(1, sizeof(thread_stats_t));
+        assert(ts != NULL);
+        pthread_mutex_lock(&stats_lock);
+        ts->next = all_stats;
+        all_stats = ts;
+        pthread_mutex_unlock(&stats_lock);
+        my_stats = ts;
     }
+    return my_stats;
+}
 
-    if (parent_inode.type != UFS_DIRECTORY) {
-        return -3;
+// Only the owning thread writes its block, so load+store is enough
+#define STAT_ADD(field, n) do { \
+        thread_stats_t *ts_ = thread_stats(); \
+        __atomic_store_n(&ts_->field, ts_->field + (n), __ATOMIC_RELAXED); \
+    } while (0)
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Upper bound (in ns) of the bucket holding the given percentile
+static unsigned long lat_percentile(unsigned long *hist, unsigned long total, int pct) {
+    unsigned long want = (total * pct + 99) / 100;
+    unsigned long seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= want && seen > 0) {
+            return 1UL << b;
+        }
     }
+    return 0;
+}
 
-    // Search through the directory entries
-    for (int i = 0; i < DIRECT_PTRS && parent_inode.direct[i] != -1; i++) {
-        dir_ent_t dir_entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
-        if (read_block(parent_inode.direct[i], dir_entries) != UFS_BLOCK_SIZE) {
-            return -1;
+static void stats_sum(thread_stats_t *sum) {
+    memset(sum, 0, sizeof(thread_stats_t));
+    pthread_mutex_lock(&stats_lock);
+    for (thread_stats_t *ts = all_stats; ts != NULL; ts = ts->next) {
+        unsigned long *src = (unsigned long *) ts;
+        unsigned long *dst = (unsigned long *) sum;
+        for (size_t i = 0; i < offsetof(thread_stats_t, next) / sizeof(unsigned long); i++) {
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
         }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
 
-        for (int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
-            if (dir_entries[j].inum != -1 && strcmp(dir_entries[j].name, name) == 0) {
-                return dir_entries[j].inum;
+// Formats a text report into buffer; returns its length (truncated to nbytes - 1)
+static int stats_format(char *buffer, int nbytes) {
+    thread_stats_t s;
+    stats_sum(&s);
+
+    int len = 0;
+#define EMIT(...) do { \
+        if (len < nbytes) \
+            len += snprintf(buffer + len, nbytes - len, __VA_ARGS__); \
+    } while (0)
+
+    EMIT("%-10s %10s %8s %10s %10s %10s %10s %10s\n", "op", "count", "errors", "avg_ns", "p50_ns", "p99_ns",
+         "commit_avg", "commit_p99");
+    for (int op = 0; op < NUM_OPS; op++) {
+        unsigned long n = s.op_count[op];
+        unsigned long commits = 0;
+        for (int b = 0; b < LAT_BUCKETS; b++) {
+            commits += s.commit_lat[op][b];
+        }
+        EMIT("%-10s %10lu %8lu %10lu %10lu %10lu %10lu %10lu\n", op_names[op], n, s.op_errors[op],
+             n ? s.op_ns[op] / n : 0,
+             lat_percentile(s.op_lat[op], n, 50),
+             lat_percentile(s.op_lat[op], n, 99),
+             commits ? s.commit_ns[op] / commits : 0,
+             lat_percentile(s.commit_lat[op], commits, 99));
+    }
+    EMIT("pread %lu pwrite %lu fdatasync %lu copy_file_range %lu\n", s.preads, s.pwrites, s.fsyncs, s.copy_ranges);
+    EMIT("group_commits %lu cbt_syncs %lu\n", s.group_commits, s.cbt_syncs);
+    EMIT("leases_granted %lu leases_recalled %lu\n", s.leases_granted, s.leases_recalled);
+    EMIT("deltas_sent %lu deltas_applied %lu deltas_lost %lu delta_bytes %lu\n", s.deltas_sent, s.deltas_applied,
+         s.deltas_lost, s.delta_bytes);
+    EMIT("defrag_files %lu defrag_blocks %lu\n", s.defrag_files, s.defrag_blocks);
+    EMIT("bytes_read %lu bytes_written %lu bytes_mapped %lu\n", s.bytes_read, s.bytes_written, s.bytes_mapped);
+    EMIT("inode_allocs %lu inode_frees %lu block_allocs %lu block_frees %lu bits_scanned %lu\n",
+         s.inode_allocs, s.inode_frees, s.block_allocs, s.block_frees, s.bits_scanned);
+    pthread_mutex_lock(&volumes_lock);
+    for (int id = 0; id < MAX_VOLUMES; id++) {
+        volume_t *v = volumes[id];
+        if (v != NULL) {
+            EMIT("volume %d %s free_inodes %ld/%d free_blocks %ld/%d seq %lu",  id, v->image_path,
+                 __atomic_load_n(&v->free_inodes, __ATOMIC_RELAXED), v->superblock.num_inodes,
+                 __atomic_load_n(&v->free_blocks, __ATOMIC_RELAXED), v->superblock.num_data,
+                 __atomic_load_n(&v->seq, __ATOMIC_RELAXED));
+            if (v->read_only) {
+                EMIT(" replica lag_ms %.2f", (v->applied_ns - v->committed_ns) / 1e6);
             }
+            EMIT("\n");
         }
     }
+    pthread_mutex_unlock(&volumes_lock);
+    EMIT("startup_ms superblock %.2f metadata %.2f summaries %.2f dir_index %.2f warm %.2f total %.2f threads %d\n",
+         startup.superblock, startup.metadata, startup.summaries, startup.dir_index,
+         startup.warm, startup.total, startup.threads);
+#undef EMIT
 
-    return -1;  // File not found
+    return (len < nbytes) ? len : nbytes - 1;
 }
 
-int MFS_Stat(int inum, MFS_Stat_t *m) {
-    if (inum < 0 || inum >= superblock.num_inodes || m == NULL) {
-        return -1;
+static void *stats_dumper(void *arg) {
+    int seconds = *(int *) arg;
+    char report[4096];
+    free(arg);
+    for (;;) {
+        sleep(seconds);
+        stats_format(report, sizeof(report));
+        fprintf(stderr, "---- mfs stats ----\n%s", report);
     }
+    return NULL;
+}
 
-    inode_t inode;
-    int inode_block = superblock.inode_region_addr + (inum / (UFS_BLOCK_SIZE / sizeof(inode_t)));
-    int inode_offset = (inum % (UFS_BLOCK_SIZE / sizeof(inode_t))) * sizeof(inode_t);
-    
-    if (pread(fs_fd, &inode, sizeof(inode_t), inode_block * UFS_BLOCK_SIZE + inode_offset) != sizeof(inode_t)) {
-        return -1;
+// Periodic text dump to stderr, enabled by MFS_STATS_INTERVAL=<seconds>
+static void start_stats_dumper(void) {
+    char *env = getenv("MFS_STATS_INTERVAL");
+    if (env == NULL || atoi(env) <= 0) {
+        return;
+    }
+    int *seconds = malloc(sizeof(int));
+    *seconds = atoi(env);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, stats_dumper, seconds) == 0) {
+        pthread_detach(tid);
+    } else {
+        free(seconds);
     }
+}
 
-    m->type = inode.type;
-    m->size = inode.size;
+// ---------------------------------------------------------------------------
+// Tracing
+//
+// Each thread records the phases of the request it is serving into its own
+// ring of fixed-size events. Writers never block: an event is filled in and
+// then published by bumping the ring's head. When tracing is switched off the
+// cost is one relaxed load per phase. Rings can be dumped as a Chrome trace
+// (chrome://tracing or ui.perfetto.dev) by MFS_TraceDump() or by SIGUSR2,
+// which writes $MFS_TRACE_FILE (default mfs-trace.json) after the next
+// request. MFS_TRACE=1 turns tracing on at MFS_Init. Build with
+// -DMFS_NO_TRACE to compile the hooks out entirely.
+// ---------------------------------------------------------------------------
 
-    return 0;
+enum {
+    PH_RECEIVE,
+    PH_DECODE,
+    PH_OP,
+    PH_INODE,
+    PH_BLOCK_IO,
+    PH_ALLOC,
+    PH_COMMIT,
+    PH_SEND,
+    NUM_PHASES
+};
+
+static const char *phase_names[NUM_PHASES] = {
+    "receive", "decode", "op", "inode_fetch", "block_io", "alloc", "commit", "send"
+};
+
+#define TRACE_RING (8192)   // events per thread, must be a power of two
+
+typedef struct {
+    unsigned long start_ns;
+    unsigned int dur_ns;
+    unsigned short phase;
+    unsigned short op;
+} trace_event_t;
+
+typedef struct trace_ring {
+    trace_event_t events[TRACE_RING];
+    unsigned long head;     // events ever written; slot is head % TRACE_RING
+    int tid;
+    struct trace_ring *next;
+} trace_ring_t;
+
+static int tracing;
+static volatile sig_atomic_t trace_dump_requested;
+static __thread int cur_op = NUM_OPS;
+static trace_ring_t *all_rings;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef MFS_NO_TRACE
+
+static __thread trace_ring_t *my_ring;
+
+static trace_ring_t *trace_ring(void) {
+    if (my_ring == NULL) {
+        trace_ring_t *r = calloc(1, sizeof(trace_ring_t));
+        if (r == NULL) {
+            return NULL;
+        }
+        r->tid = (int) syscall(SYS_gettid);
+        pthread_mutex_lock(&trace_lock);
+        r->next = all_rings;
+        all_rings = r;
+        pthread_mutex_unlock(&trace_lock);
+        my_ring = r;
+    }
+    return my_ring;
 }
 
+// Returns the phase start time, or 0 when tracing is off
+unsigned long trace_begin(void) {
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return now_ns();
+}
 
-int get_inode(int inum, inode_t *inode) {
-    if (inum < 0 || inum >= superblock.num_inodes) {
-        return -1;
+void trace_end(int phase, unsigned long start) {
+    if (start == 0) {
+        return;
     }
+    trace_ring_t *r = trace_ring();
+    if (r == NULL) {
+        return;
+    }
+    trace_event_t *e = &r->events[r->head & (TRACE_RING - 1)];
+    e->start_ns = start;
+    e->dur_ns = (unsigned int) (now_ns() - start);
+    e->phase = phase;
+    e->op = cur_op;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
 
-    int inode_block = superblock.inode_region_addr + (inum / (UFS_BLOCK_SIZE / sizeof(inode_t)));
-    int inode_offset = (inum % (UFS_BLOCK_SIZE / sizeof(inode_t))) * sizeof(inode_t);
-    
-    if (pread(fs_fd, inode, sizeof(inode_t), inode_block * UFS_BLOCK_SIZE + inode_offset) != sizeof(inode_t)) {
-        return -1;
+#else
+
+unsigned long trace_begin(void) { return 0; }
+void trace_end(int phase, unsigned long start) { (void) phase; (void) start; }
+
+#endif
+
+void trace_enable(int on) {
+    __atomic_store_n(&tracing, on ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+static void trace_emit_ring(FILE *out, trace_ring_t *r, int *first) {
+    static trace_event_t copy[TRACE_RING];
+    unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned long from = (head > TRACE_RING) ? head - TRACE_RING : 0;
+
+    for (unsigned long i = from; i < head; i++) {
+        copy[i & (TRACE_RING - 1)] = r->events[i & (TRACE_RING - 1)];
     }
 
-    return 0;
+    // The owner kept writing while we copied; drop anything it may have lapped
+    unsigned long now = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (now > TRACE_RING && now - TRACE_RING > from) {
+        from = now - TRACE_RING;
+    }
+
+    for (unsigned long i = from; i < head; i++) {
+        trace_event_t *e = &copy[i & (TRACE_RING - 1)];
+        const char *name = (e->phase == PH_OP && e->op < NUM_OPS) ? op_names[e->op] : phase_names[e->phase];
+        fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"op\":\"%s\"}}",
+                *first ? "" : ",", name, phase_names[e->phase],
+                e->start_ns / 1000.0, e->dur_ns / 1000.0, (int) getpid(), r->tid,
+                e->op < NUM_OPS ? op_names[e->op] : "none");
+        *first = 0;
+    }
 }
 
-int put_inode(int inum, inode_t *inode) {
-    if (inum < 0 || inum >= superblock.num_inodes) {
+// Writes every thread's ring to path as Chrome trace JSON
+int trace_dump(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
         return -1;
     }
 
-    int inode_block = superblock.inode_region_addr + (inum / (UFS_BLOCK_SIZE / sizeof(inode_t)));
-    int inode_offset = (inum % (UFS_BLOCK_SIZE / sizeof(inode_t))) * sizeof(inode_t);
-    
-    if (pwrite(fs_fd, inode, sizeof(inode_t), inode_block * UFS_BLOCK_SIZE + inode_offset) != sizeof(inode_t)) {
-        return -1;
+    int first = 1;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    pthread_mutex_lock(&trace_lock);
+    for (trace_ring_t *r = all_rings; r != NULL; r = r->next) {
+        trace_emit_ring(out, r, &first);
     }
+    pthread_mutex_unlock(&trace_lock);
+    fprintf(out, "\n]}\n");
 
-    return 0;
+    return (fclose(out) == 0) ? 0 : -1;
 }
 
-int set_bitmap(int bitmap_start, int bitmap_len, int index, int value) {
-    int byte_index = index / 8;
-    int bit_index = index % 8;
-    unsigned char byte;
+static void trace_signal(int sig) {
+    (void) sig;
+    trace_dump_requested = 1;
+}
 
-    if (byte_index >= bitmap_len * UFS_BLOCK_SIZE) {
-        return -1;
+static void start_tracing(void) {
+    char *env = getenv("MFS_TRACE");
+    if (env != NULL && atoi(env) > 0) {
+        trace_enable(1);
     }
+    signal(SIGUSR2, trace_signal);
+}
 
-    int block = bitmap_start + (byte_index / UFS_BLOCK_SIZE);
-    int offset = byte_index % UFS_BLOCK_SIZE;
+// ---------------------------------------------------------------------------
+// Operation envelope
+// ---------------------------------------------------------------------------
 
-    if (pread(fs_fd, &byte, 1, block * UFS_BLOCK_SIZE + offset) != 1) {
-        return -1;
-    }
+static int lat_bucket(unsigned long ns) {
+    int bucket = (ns == 0) ? 0 : 64 - __builtin_clzl(ns);
+    return (bucket < LAT_BUCKETS) ? bucket : LAT_BUCKETS - 1;
+}
 
-    if (value)
-        byte |= (1 << bit_index);
-    else
-        byte &= ~(1 << bit_index);
+static unsigned long op_begin(int op) {
+    cur_op = op;
+    return now_ns();
+}
 
-    if (pwrite(fs_fd, &byte, 1, block * UFS_BLOCK_SIZE + offset) != 1) {
-        return -1;
+static void op_end(int op, unsigned long start, int failed) {
+    unsigned long end = now_ns();
+    unsigned long ns = end - start;
+    STAT_ADD(op_count[op], 1);
+    STAT_ADD(op_ns[op], ns);
+    STAT_ADD(op_lat[op][lat_bucket(ns)], 1);
+    if (failed) {
+        STAT_ADD(op_errors[op], 1);
     }
 
-    return 0;
+    if (__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+        trace_end(PH_OP, start);
+    }
+    cur_op = NUM_OPS;
+
+    if (trace_dump_requested) {
+        trace_dump_requested = 0;
+        char *path = getenv("MFS_TRACE_FILE");
+        trace_dump(path != NULL ? path : "mfs-trace.json");
+    }
 }
 
-int find_free_bit(int bitmap_start, int bitmap_len, int num_bits) {
-    unsigned char byte;
-    for (int i = 0; i < num_bits; i++) {
-        int byte_index = i / 8;
-        int bit_index = i % 8;
+// ---------------------------------------------------------------------------
+// Changed-block tracking
+//
+// When the image has a sidecar (<image>.cbt, laid out in ufs.h) the engine
+// sets a block's bit before it first writes the block in a backup epoch, so
+// the backup tool can copy just those blocks. Bits live in a shared mapping
+// and are set with atomic ORs, so every volume and process on the image
+// sees them and a crashed process leaves them in the page cache. A write
+// that sets a new bit syncs the sidecar before it is issued, since once in
+// the page cache the image block can reach the disk at any time (writeback,
+// or another op's fdatasync); rewriting a block already marked costs
+// nothing. Changes hold the volume's lock across both, so no other write to
+// the block can slip in between. Mounts hold a shared flock on the
+// sidecar and the backup tool an exclusive one. MFS_CBT=1 creates a missing
+// sidecar with every bit set, as nothing is backed up yet; an existing one
+// is always kept current.
+// ---------------------------------------------------------------------------
 
-        if (byte_index % UFS_BLOCK_SIZE == 0) {
-            if (pread(fs_fd, &byte, 1, (bitmap_start + byte_index / UFS_BLOCK_SIZE) * UFS_BLOCK_SIZE) != 1) {
-                return -1;
-            }
+static int cbt_create;             // MFS_CBT=1
+
+static int cbt_open(void) {
+    int nblocks = vol->superblock.data_region_addr + vol->superblock.data_region_len;
+    size_t len = UFS_BLOCK_SIZE + (size_t) (nblocks + 31) / 32 * sizeof(unsigned int);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.cbt", vol->image_path);
+    int fd = open(path, O_RDWR | (cbt_create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    struct stat st;
+    if (flock(fd, LOCK_SH | LOCK_NB) != 0 || fstat(fd, &st) != 0 ||
+        (st.st_size != 0 && st.st_size != (off_t) len) ||
+        (st.st_size == 0 && ftruncate(fd, len) != 0)) {
+        fprintf(stderr, "%s is being backed up or does not match the image\n", path);
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    cbt_header_t *h = (cbt_header_t *) map;
+    if (st.st_size == 0) {
+        memset(map + UFS_BLOCK_SIZE, 0xff, len - UFS_BLOCK_SIZE);
+        h->nblocks = nblocks;
+        h->epoch = 0;
+        h->magic = UFS_CBT_MAGIC;
+        if (fdatasync(fd) != 0) {
+            h->magic = 0;
         }
+    }
+    if (h->magic != UFS_CBT_MAGIC || h->nblocks != nblocks) {
+        fprintf(stderr, "%s does not match the image\n", path);
+        munmap(map, len);
+        close(fd);
+        return -1;
+    }
+    vol->cbt_fd = fd;
+    vol->cbt_map = map;
+    vol->cbt_len = len;
+    return 0;
+}
+
+static void cbt_close(void) {
+    if (vol->cbt_map != NULL) {
+        munmap(vol->cbt_map, vol->cbt_len);
+        vol->cbt_map = NULL;
+    }
+    if (vol->cbt_fd != -1) {
+        close(vol->cbt_fd);
+        vol->cbt_fd = -1;
+    }
+}
 
-        if (!(byte & (1 << bit_index))) {
-            return i;
+// Marks the blocks under [offset, offset + len) changed, durably if any bit
+// is new; called before they are written. A bit that is already set is only
+// known durable once a sync has worked since it was set: after a failed one
+// every write syncs again first, so a retry cannot slip past it.
+static int cbt_mark(off_t offset, size_t len) {
+    if (vol->cbt_map == NULL || len == 0) {
+        return 0;
+    }
+    unsigned int *bits = (unsigned int *) (vol->cbt_map + UFS_BLOCK_SIZE);
+    int fresh = 0;
+    for (off_t b = offset / UFS_BLOCK_SIZE; b <= (offset + (off_t) len - 1) / UFS_BLOCK_SIZE; b++) {
+        unsigned int mask = 0x1u << (31 - b % 32);
+        if ((__atomic_load_n(&bits[b / 32], __ATOMIC_RELAXED) & mask) == 0) {
+            __atomic_fetch_or(&bits[b / 32], mask, __ATOMIC_RELAXED);
+            fresh = 1;
         }
     }
-    return -1;
+    if (!fresh && !vol->cbt_unsynced) {
+        return 0;
+    }
+    vol->cbt_unsynced = 1;
+    STAT_ADD(cbt_syncs, 1);
+    if (fdatasync(vol->cbt_fd) != 0) {
+        return -1;
+    }
+    vol->cbt_unsynced = 0;
+    return 0;
 }
 
-int allocate_inode() {
-    int inum = find_free_bit(superblock.inode_bitmap_addr, superblock.inode_bitmap_len, superblock.num_inodes);
-    if (inum == -1) return -1;
-    if (set_bitmap(superblock.inode_bitmap_addr, superblock.inode_bitmap_len, inum, 1) == -1) return -1;
-    return inum;
+// ---------------------------------------------------------------------------
+// Image I/O. All access to the image goes through these so it gets counted,
+// and every write is recorded in the calling thread's dirty list so that
+// commit() knows whether there is anything to make durable and what to
+// ship to a replicator.
+// ---------------------------------------------------------------------------
+
+static __thread range_t *dirty;
+static __thread int dirty_count;
+static __thread int dirty_cap;
+static pthread_key_t dirty_key;    // frees a thread's list when it exits
+static pthread_key_t events_key;   // ...and its replication events
+
+// Makes room for one more range before the write it records, so a failed
+// allocation fails the write instead of leaving it out of the list
+static int dirty_reserve(void) {
+    if (dirty_count < dirty_cap) {
+        return 0;
+    }
+    int cap = dirty_cap ? dirty_cap * 2 : 16;
+    range_t *grown = realloc(dirty, cap * sizeof(range_t));
+    if (grown == NULL) {
+        return -1;
+    }
+    pthread_setspecific(dirty_key, grown);
+    dirty = grown;
+    dirty_cap = cap;
+    return 0;
 }
 
-int allocate_data_block() {
-    int block_num = find_free_bit(superblock.data_bitmap_addr, superblock.data_bitmap_len, superblock.num_data);
-    if (block_num == -1) return -1;
-    if (set_bitmap(superblock.data_bitmap_addr, superblock.data_bitmap_len, block_num, 1) == -1) return -1;
-    return superblock.data_region_addr + block_num;
+// Ops mostly write a few blocks, often adjacent, so merge with the last range.
+// The caller has reserved a slot.
+static void dirty_add(off_t start, size_t len) {
+    if (dirty_count > 0 && start <= dirty[dirty_count - 1].end &&
+        start + (off_t) len >= dirty[dirty_count - 1].start) {
+        range_t *r = &dirty[dirty_count - 1];
+        r->start = (start < r->start) ? start : r->start;
+        r->end = (start + (off_t) len > r->end) ? start + (off_t) len : r->end;
+        return;
+    }
+    dirty[dirty_count].start = start;
+    dirty[dirty_count].end = start + len;
+    dirty_count++;
 }
 
-int free_data_block(int block_num) {
-    int rel_block_num = block_num - superblock.data_region_addr;
-    return set_bitmap(superblock.data_bitmap_addr, superblock.data_bitmap_len, rel_block_num, 0);
+static ssize_t disk_pread(void *buffer, size_t count, off_t offset) {
+    ssize_t rc = pread(vol->fd, buffer, count, offset);
+    STAT_ADD(preads, 1);
+    if (rc > 0) {
+        STAT_ADD(bytes_read, rc);
+    }
+    return rc;
 }
 
-int MFS_Read(int inum, char *buffer, int offset, int nbytes) {
-    if (inum < 0 || buffer == NULL || offset < 0 || nbytes < 0) {
+static ssize_t disk_pwrite(const void *buffer, size_t count, off_t offset) {
+    if (dirty_reserve() != 0 || cbt_mark(offset, count) != 0) {
         return -1;
     }
+    ssize_t rc = pwrite(vol->fd, buffer, count, offset);
+    STAT_ADD(pwrites, 1);
+    if (rc > 0) {
+        STAT_ADD(bytes_written, rc);
+        dirty_add(offset, rc);
+    }
+    return rc;
+}
 
-    inode_t inode;
-    if (get_inode(inum, &inode) != 0) {
+// Copies len bytes inside the image without bringing them into user space,
+// falling back to a bounce buffer where copy_file_range is unsupported
+static int disk_copy(off_t from, off_t to, size_t len) {
+    if (dirty_reserve() != 0 || cbt_mark(to, len) != 0) {
         return -1;
     }
-
-    if (offset >= inode.size) {
-        return 0;  // Nothing to read
+    while (len > 0) {
+        loff_t in = from, out = to;
+        ssize_t rc = copy_file_range(vol->fd, &in, vol->fd, &out, len, 0);
+        STAT_ADD(copy_ranges, 1);
+        if (rc <= 0) {
+            break;
+        }
+        STAT_ADD(bytes_read, rc);
+        STAT_ADD(bytes_written, rc);
+        dirty_add(to, rc);
+        from += rc;
+        to += rc;
+        len -= rc;
+    }
+    if (len == 0) {
+        return 0;
     }
 
-    int bytes_to_read = (offset + nbytes > inode.size) ? (inode.size - offset) : nbytes;
-    int bytes_read = 0;
+    char *buffer = malloc(len);
+    if (buffer == NULL) {
+        return -1;
+    }
+    int rc = (disk_pread(buffer, len, from) == (ssize_t) len &&
+              disk_pwrite(buffer, len, to) == (ssize_t) len) ? 0 : -1;
+    free(buffer);
+    return rc;
+}
 
-    while (bytes_read < bytes_to_read) {
-        int block_index = (offset + bytes_read) / UFS_BLOCK_SIZE;
-        int block_offset = (offset + bytes_read) % UFS_BLOCK_SIZE;
+// Durability is not range-limited: fdatasync flushes every dirty page of the
+// image, whichever op wrote it, and the device cache with them. The saving is
+// in sharing it. Skipping the mtime update is all it spares over fsync.
+static int sync_image(int fd) {
+    STAT_ADD(fsyncs, 1);
+    return fdatasync(fd);
+}
 
-        if (block_index >= DIRECT_PTRS) {
-            break;  // We don't support indirect blocks in this implementation
+// Group commit: the flusher takes every op queued since its last pass and
+// makes the whole batch durable with a single fdatasync
+static void *flusher(void *arg) {
+    volume_t *v = arg;
+    pthread_mutex_lock(&v->flush_lock);
+    for (;;) {
+        while (v->flush_queue == NULL && !v->flush_stop) {
+            pthread_cond_wait(&v->flush_wake, &v->flush_lock);
         }
-
-        int data_block = inode.direct[block_index];
-        if (data_block == -1) {
-            break;  // Reached the end of allocated blocks
+        if (v->flush_queue == NULL) {
+            break;
         }
+        commit_req_t *batch = v->flush_queue;
+        v->flush_queue = NULL;
+        pthread_mutex_unlock(&v->flush_lock);
 
-        char block_buffer[UFS_BLOCK_SIZE];
-        if (read_block(data_block, block_buffer) != UFS_BLOCK_SIZE) {
-            return -1;
-        }
+        int rc = sync_image(v->fd);
 
-        int bytes_to_copy = UFS_BLOCK_SIZE - block_offset;
-        if (bytes_to_copy > bytes_to_read - bytes_read) {
-            bytes_to_copy = bytes_to_read - bytes_read;
+        pthread_mutex_lock(&v->flush_lock);
+        for (commit_req_t *r = batch; r != NULL; r = r->next) {
+            STAT_ADD(group_commits, 1);
+            r->rc = rc;
+            r->done = 1;
         }
-
-        memcpy(buffer + bytes_read, block_buffer + block_offset, bytes_to_copy);
-        bytes_read += bytes_to_copy;
+        pthread_cond_broadcast(&v->flush_done);
     }
+    pthread_mutex_unlock(&v->flush_lock);
+    return NULL;
+}
 
-    return bytes_read;
+static void start_flusher(volume_t *v) {
+    pthread_mutex_init(&v->flush_lock, NULL);
+    pthread_cond_init(&v->flush_wake, NULL);
+    pthread_cond_init(&v->flush_done, NULL);
+    v->flusher_running = pthread_create(&v->flusher, NULL, flusher, v) == 0;
 }
 
-int MFS_Write(int inum, char *buffer, int offset, int nbytes) {
-    if (inum < 0 || buffer == NULL || offset < 0 || nbytes < 0) {
-        return -1;
+static void stop_flusher(volume_t *v) {
+    if (v->flusher_running) {
+        pthread_mutex_lock(&v->flush_lock);
+        v->flush_stop = 1;
+        pthread_cond_signal(&v->flush_wake);
+        pthread_mutex_unlock(&v->flush_lock);
+        pthread_join(v->flusher, NULL);
+        v->flusher_running = 0;
     }
+    pthread_mutex_destroy(&v->flush_lock);
+    pthread_cond_destroy(&v->flush_wake);
+    pthread_cond_destroy(&v->flush_done);
+}
 
-    inode_t inode;
-    if (get_inode(inum, &inode) != 0) {
+static void replicate(int durable);
+
+// Make every change so far durable before we acknowledge it: queues this op
+// on the volume's flusher and waits for the fdatasync that covers it
+static int commit(void) {
+    if (vol == NULL) {
         return -1;
     }
+    if (dirty_count == 0) {
+        return 0;
+    }
+    unsigned long t = trace_begin();
+    unsigned long start = now_ns();
+    commit_req_t req = { 0, 0, NULL };
+    if (vol->flusher_running) {
+        pthread_mutex_lock(&vol->flush_lock);
+        req.next = vol->flush_queue;
+        vol->flush_queue = &req;
+        pthread_cond_signal(&vol->flush_wake);
+        while (!req.done) {
+            pthread_cond_wait(&vol->flush_done, &vol->flush_lock);
+        }
+        pthread_mutex_unlock(&vol->flush_lock);
+    } else {
+        req.rc = sync_image(vol->fd);
+    }
+    replicate(req.rc == 0);
+    dirty_count = 0;
 
-    if (inode.type != UFS_REGULAR_FILE) {
-        return -1;  // Can only write to regular files
+    if (cur_op < NUM_OPS) {
+        unsigned long ns = now_ns() - start;
+        STAT_ADD(commit_ns[cur_op], ns);
+        STAT_ADD(commit_lat[cur_op][lat_bucket(ns)], 1);
     }
+    trace_end(PH_COMMIT, t);
+    return req.rc;
+}
 
-    int bytes_written = 0;
+// Blocks past the end of the image (as the superblock describes it) are
+// refused rather than read or written at a wrapped-around offset
+static int block_ok(int block_num) {
+    return block_num >= 0 && block_num < vol->superblock.data_region_addr + vol->superblock.data_region_len;
+}
 
-    while (bytes_written < nbytes) {
-        int block_index = (offset + bytes_written) / UFS_BLOCK_SIZE;
-        int block_offset = (offset + bytes_written) % UFS_BLOCK_SIZE;
+int read_block(int block_num, void *buffer) {
+    if (!block_ok(block_num)) {
+        return -1;
+    }
+    unsigned long t = trace_begin();
+    int rc = disk_pread(buffer, UFS_BLOCK_SIZE, (off_t) block_num * UFS_BLOCK_SIZE);
+    trace_end(PH_BLOCK_IO, t);
+    return rc;
+}
 
-        if (block_index >= DIRECT_PTRS) {
-            break;  // We don't support indirect blocks in this implementation
-        }
+int write_block(int block_num, void *buffer) {
+    if (!block_ok(block_num)) {
+        return -1;
+    }
+    unsigned long t = trace_begin();
+    int rc = disk_pwrite(buffer, UFS_BLOCK_SIZE, (off_t) block_num * UFS_BLOCK_SIZE);
+    trace_end(PH_BLOCK_IO, t);
+    return rc;
+}
 
-        if (inode.direct[block_index] == -1) {
-            // Allocate a new block
-            int new_block = allocate_data_block();
-            if (new_block == -1) {
-                return bytes_written;  // No more free blocks
-            }
-            inode.direct[block_index] = new_block;
-        }
+// ---------------------------------------------------------------------------
+// In-memory metadata
+//
+// At boot the bitmaps and inode table, which mkfs lays out back to back in
+// blocks 1 .. data_region_addr - 1, are pulled in with a few large sequential
+// reads and kept in memory. Updates are written through to the image. Warm
+// structures that would otherwise cost directory scans are then built by
+// parallel threads:
+//   - free-bit counts for every bitmap block and every group of
+//     GROUP_WORDS words inside it, so allocation can skip full regions
+//   - a (parent inode, name) -> inode index over every directory entry
+//   - a parent map from each inode to the directory that names it
+// ---------------------------------------------------------------------------
 
-        char block_buffer[UFS_BLOCK_SIZE];
-        if (read_block(inode.direct[block_index], block_buffer) != UFS_BLOCK_SIZE) {
-            return -1;
-        }
+#define META_READ_SIZE (8 << 20)   // bytes per read while loading metadata
+#define INDEX_CHUNK (1024)         // inodes claimed at a time by index builders
 
-        int bytes_to_copy = UFS_BLOCK_SIZE - block_offset;
-        if (bytes_to_copy > nbytes - bytes_written) {
-            bytes_to_copy = nbytes - bytes_written;
-        }
+static int compact_dirs;           // MFS_DIR_COMPACT=1
+static int placement_lowest;       // MFS_PLACEMENT=lowest
 
-        memcpy(block_buffer + block_offset, buffer + bytes_written, bytes_to_copy);
+static double ms_since(unsigned long start) {
+    return (now_ns() - start) / 1e6;
+}
 
-        if (write_block(inode.direct[block_index], block_buffer) != UFS_BLOCK_SIZE) {
-            return -1;
-        }
+// Bitmaps use the mkfs layout: an array of 32-bit words, where bit i lives at
+// (0x1 << (31 - i % 32)) of word i / 32.
+static int bit_test(bitmap_t *map, int index) {
+    return (map->words[index / 32] >> (31 - index % 32)) & 0x1;
+}
 
-        bytes_written += bytes_to_copy;
+static unsigned int name_hash(int pinum, const char *name) {
+    unsigned int h = 2166136261u ^ (unsigned int) pinum;
+    h *= 16777619u;
+    for (int i = 0; i < 28 && name[i] != '\0'; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 16777619u;
     }
+    return h;
+}
 
-    // Update inode size if necessary
-    if (offset + bytes_written > inode.size) {
-        inode.size = offset + bytes_written;
-    }
-    
-    if (put_inode(inum, &inode) != 0) {
+static void repl_event(char kind, int pinum, const char *name, int inum);
+
+static int index_insert(int pinum, const char *name, int inum) {
+    repl_event('+', pinum, name, inum);
+    name_node_t *n = malloc(sizeof(name_node_t));
+    if (n == NULL) {
         return -1;
     }
+    n->pinum = pinum;
+    n->inum = inum;
+    memset(n->name, 0, sizeof(n->name));
+    strncpy(n->name, name, sizeof(n->name) - 1);
 
-    return bytes_written;
+    // Index builders insert concurrently, so push onto the chain with a CAS
+    name_node_t **head = &vol->name_index[name_hash(pinum, name) & vol->name_index_mask];
+    n->next = __atomic_load_n(head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(head, &n->next, n, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return 0;
 }
 
-int MFS_Creat(int pinum, int type, char *name) {
-    if (pinum < 0 || (type != UFS_REGULAR_FILE && type != UFS_DIRECTORY) || name == NULL || strlen(name) > 27) {
-        return -1;
+static int index_find(int pinum, const char *name) {
+    name_node_t *n = vol->name_index[name_hash(pinum, name) & vol->name_index_mask];
+    for (; n != NULL; n = n->next) {
+        if (n->pinum == pinum && strncmp(n->name, name, sizeof(n->name)) == 0) {
+            return n->inum;
+        }
     }
+    return -1;
+}
 
-    inode_t parent_inode;
-    if (get_inode(pinum, &parent_inode) != 0 || parent_inode.type != UFS_DIRECTORY) {
-        return -2;
+static void index_remove(int pinum, const char *name) {
+    repl_event('-', pinum, name, -1);
+    name_node_t **p = &vol->name_index[name_hash(pinum, name) & vol->name_index_mask];
+    for (; *p != NULL; p = &(*p)->next) {
+        if ((*p)->pinum == pinum && strncmp((*p)->name, name, sizeof((*p)->name)) == 0) {
+            name_node_t *dead = *p;
+            *p = dead->next;
+            free(dead);
+            return;
+        }
     }
+}
+
+// Record a new entry name -> inum in directory pinum
+static void index_add_entry(int pinum, const char *name, int inum, int type) {
+    index_insert(pinum, name, inum);
+    vol->parent_of[inum] = pinum;
+    if (type == UFS_DIRECTORY) {
+        index_insert(inum, ".", inum);
+        index_insert(inum, "..", pinum);
+        vol->child_block[inum] = -1;
+    }
+}
+
+static void index_remove_entry(int pinum, const char *name, int inum, int type) {
+    index_remove(pinum, name);
+    vol->parent_of[inum] = -1;
+    if (type == UFS_DIRECTORY) {
+        index_remove(inum, ".");
+        index_remove(inum, "..");
+    }
+}
+
+static void free_leases(void);
+
+static void free_metadata(void) {
+    free_leases();
+    if (vol->name_index != NULL) {
+        for (unsigned int i = 0; i <= vol->name_index_mask; i++) {
+            name_node_t *n = vol->name_index[i];
+            while (n != NULL) {
+                name_node_t *next = n->next;
+                free(n);
+                n = next;
+            }
+        }
+    }
+    if (vol->dir_slot_cache != NULL) {
+        for (int i = 0; i < vol->superblock.num_inodes; i++) {
+            free(vol->dir_slot_cache[i]);
+        }
+    }
+    free(vol->dir_slot_cache);
+    vol->dir_slot_cache = NULL;
+    free(vol->name_index);
+    free(vol->parent_of);
+    free(vol->child_block);
+    free(vol->inode_map.block_free);
+    free(vol->data_map.block_free);
+    free(vol->inode_map.group_free);
+    free(vol->data_map.group_free);
+    free(vol->metadata);
+    vol->name_index = NULL;
+    vol->parent_of = NULL;
+    vol->child_block = NULL;
+    vol->metadata = NULL;
+    vol->inode_table = NULL;
+    memset(&vol->inode_map, 0, sizeof(bitmap_t));
+    memset(&vol->data_map, 0, sizeof(bitmap_t));
+}
+
+static int superblock_ok(off_t image_size) {
+    super_t *s = &vol->superblock;
+    return s->num_inodes > 0 && s->num_data > 0 &&
+           s->inode_bitmap_addr == 1 &&
+           s->data_bitmap_addr == s->inode_bitmap_addr + s->inode_bitmap_len &&
+           s->inode_region_addr == s->data_bitmap_addr + s->data_bitmap_len &&
+           s->data_region_addr == s->inode_region_addr + s->inode_region_len &&
+           (long) s->inode_bitmap_len * BITS_PER_BLOCK >= s->num_inodes &&
+           (long) s->data_bitmap_len * BITS_PER_BLOCK >= s->num_data &&
+           (long) s->inode_region_len * INODES_PER_BLOCK >= s->num_inodes &&
+           (long) s->data_region_addr + s->data_region_len <= INT_MAX &&
+           ((off_t) s->data_region_addr + s->data_region_len) * UFS_BLOCK_SIZE <= image_size;
+}
+
+// Read the bitmaps and inode table in a few large sequential reads
+static int load_metadata(void) {
+    size_t len = (size_t) (vol->superblock.data_region_addr - 1) * UFS_BLOCK_SIZE;
+    vol->metadata = malloc(len);
+    if (vol->metadata == NULL) {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        size_t want = (len - done < META_READ_SIZE) ? len - done : META_READ_SIZE;
+        ssize_t rc = disk_pread(vol->metadata + done, want, UFS_BLOCK_SIZE + done);
+        if (rc <= 0) {
+            return -1;
+        }
+        done += rc;
+    }
+
+    vol->inode_map.addr = vol->superblock.inode_bitmap_addr;
+    vol->inode_map.len = vol->superblock.inode_bitmap_len;
+    vol->inode_map.num_bits = vol->superblock.num_inodes;
+    vol->inode_map.words = (unsigned int *) (vol->metadata + (size_t) (vol->inode_map.addr - 1) * UFS_BLOCK_SIZE);
+    vol->inode_map.gauge = &vol->free_inodes;
+
+    vol->data_map.addr = vol->superblock.data_bitmap_addr;
+    vol->data_map.len = vol->superblock.data_bitmap_len;
+    vol->data_map.num_bits = vol->superblock.num_data;
+    vol->data_map.words = (unsigned int *) (vol->metadata + (size_t) (vol->data_map.addr - 1) * UFS_BLOCK_SIZE);
+    vol->data_map.gauge = &vol->free_blocks;
+
+    vol->inode_table = (inode_t *) (vol->metadata + (size_t) (vol->superblock.inode_region_addr - 1) * UFS_BLOCK_SIZE);
+    return 0;
+}
+
+// Only the first num_bits bits count; the tail of the last block is ignored
+static void summarize_bitmap(bitmap_t *map) {
+    long total = 0;
+    int groups = map->len * GROUPS_PER_BLOCK;
+    for (int g = 0; g < groups; g++) {
+        int first = g * GROUP_BITS;
+        int bits = map->num_bits - first;
+        if (bits > GROUP_BITS) {
+            bits = GROUP_BITS;
+        } else if (bits < 0) {
+            bits = 0;
+        }
+        unsigned int *words = map->words + first / 32;
+        int used = 0;
+        for (int w = 0; w < bits / 32; w++) {
+            used += __builtin_popcount(words[w]);
+        }
+        if (bits % 32 != 0) {
+            used += __builtin_popcount(words[bits / 32] >> (32 - bits % 32));
+        }
+        map->group_free[g] = bits - used;
+        map->block_free[g / GROUPS_PER_BLOCK] += bits - used;
+        total += bits - used;
+    }
+    *map->gauge = total;
+}
+
+static void *build_summaries(void *arg) {
+    vol = arg;
+    unsigned long start = now_ns();
+    summarize_bitmap(&vol->inode_map);
+    summarize_bitmap(&vol->data_map);
+    startup.summaries = ms_since(start);
+    return NULL;
+}
+
+static void *build_dir_index(void *arg) {
+    vol = arg;
+    unsigned long start = now_ns();
+    dir_ent_t entries[ENTRIES_PER_BLOCK];
+    int first;
+
+    while ((first = __atomic_fetch_add(&vol->next_index_chunk, INDEX_CHUNK, __ATOMIC_RELAXED)) < vol->superblock.num_inodes) {
+        int last = (first + INDEX_CHUNK < vol->superblock.num_inodes) ? first + INDEX_CHUNK : vol->superblock.num_inodes;
+        for (int inum = first; inum < last; inum++) {
+            if (!bit_test(&vol->inode_map, inum) || vol->inode_table[inum].type != UFS_DIRECTORY) {
+                continue;
+            }
+            for (int i = 0; i < DIRECT_PTRS; i++) {
+                if (vol->inode_table[inum].direct[i] == -1 ||
+                    read_block(vol->inode_table[inum].direct[i], entries) != UFS_BLOCK_SIZE) {
+                    continue;
+                }
+                for (int j = 0; j < ENTRIES_PER_BLOCK; j++) {
+                    dir_ent_t *e = &entries[j];
+                    if (e->inum < 0 || e->inum >= vol->superblock.num_inodes) {
+                        continue;
+                    }
+                    index_insert(inum, e->name, e->inum);
+                    if (strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0) {
+                        vol->parent_of[e->inum] = inum;
+                    }
+                }
+            }
+        }
+    }
+
+    double ms = ms_since(start);
+    pthread_mutex_lock(&stats_lock);
+    if (ms > startup.dir_index) {
+        startup.dir_index = ms;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return NULL;
+}
+
+// One thread summarizes the bitmaps while the rest index directories
+static int build_warm_structures(void) {
+    unsigned int buckets = 1024;
+    while (buckets < (unsigned int) vol->superblock.num_inodes) {
+        buckets <<= 1;
+    }
+    vol->name_index = calloc(buckets, sizeof(name_node_t *));
+    vol->name_index_mask = buckets - 1;
+    vol->parent_of = malloc(vol->superblock.num_inodes * sizeof(int));
+    vol->child_block = malloc(vol->superblock.num_inodes * sizeof(int));
+    vol->dir_slot_cache = calloc(vol->superblock.num_inodes, sizeof(dir_slots_t *));
+    vol->inode_map.block_free = calloc(vol->inode_map.len, sizeof(int));
+    vol->data_map.block_free = calloc(vol->data_map.len, sizeof(int));
+    vol->inode_map.group_free = calloc(vol->inode_map.len * GROUPS_PER_BLOCK, sizeof(int));
+    vol->data_map.group_free = calloc(vol->data_map.len * GROUPS_PER_BLOCK, sizeof(int));
+    if (vol->name_index == NULL || vol->parent_of == NULL || vol->child_block == NULL || vol->dir_slot_cache == NULL ||
+        vol->inode_map.block_free == NULL || vol->data_map.block_free == NULL ||
+        vol->inode_map.group_free == NULL || vol->data_map.group_free == NULL) {
+        return -1;
+    }
+    memset(vol->parent_of, 0xff, vol->superblock.num_inodes * sizeof(int));
+    memset(vol->child_block, 0xff, vol->superblock.num_inodes * sizeof(int));
+
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    startup.threads = nthreads + 1;
+    vol->next_index_chunk = 0;
+
+    pthread_t tids[nthreads + 1];
+    int started[nthreads + 1];
+    for (int i = 0; i <= nthreads; i++) {
+        void *(*fn)(void *) = (i == 0) ? build_summaries : build_dir_index;
+        started[i] = pthread_create(&tids[i], NULL, fn, vol) == 0;
+        if (!started[i]) {
+            fn(vol);
+        }
+    }
+    for (int i = 0; i <= nthreads; i++) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+    return 0;
+}
+
+// Opens filename and loads it into vol
+static int load_volume(char *filename) {
+    unsigned long boot = now_ns();
+    memset(&startup, 0, sizeof(startup));
+
+    vol->image_path = strdup(filename);
+    vol->fd = open(vol->image_path, O_RDWR);
+    if (vol->fd < 0) {
+        perror("Unable to open filesystem image");
+        return -1;
+    }
+
+    struct stat st;
+    if (disk_pread(&vol->superblock, sizeof(super_t), 0) != sizeof(super_t) ||
+        fstat(vol->fd, &st) != 0 || !superblock_ok(st.st_size)) {
+        fprintf(stderr, "Bad or unreadable superblock\n");
+        close(vol->fd);
+        vol->fd = -1;
+        return -1;
+    }
+    if (cbt_open() != 0) {
+        close(vol->fd);
+        vol->fd = -1;
+        return -1;
+    }
+    startup.superblock = ms_since(boot);
+
+    // Reads can be answered straight from the page cache through this
+    // mapping; without it MFS_ReadMap fails and callers use MFS_Read
+    vol->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, vol->fd, 0);
+    if (vol->map == MAP_FAILED) {
+        vol->map = NULL;
+    } else {
+        vol->map_len = st.st_size;
+    }
+
+    unsigned long phase = now_ns();
+    if (load_metadata() != 0) {
+        perror("Unable to read metadata");
+        free_metadata();
+        cbt_close();
+        close(vol->fd);
+        vol->fd = -1;
+        return -1;
+    }
+    startup.metadata = ms_since(phase);
+
+    phase = now_ns();
+    if (build_warm_structures() != 0) {
+        perror("Unable to build in-memory indexes");
+        free_metadata();
+        cbt_close();
+        close(vol->fd);
+        vol->fd = -1;
+        return -1;
+    }
+    startup.warm = ms_since(phase);
+    startup.total = ms_since(boot);
+    return 0;
+}
+
+// Makes v the calling thread's volume, moving its count of users over from
+// the one it had. Called with volumes_lock held.
+static void select_volume(volume_t *v) {
+    if (vol == v) {
+        return;
+    }
+    if (vol != NULL) {
+        vol->users--;
+    }
+    if (v != NULL) {
+        v->users++;
+    }
+    vol = v;
+    pthread_setspecific(vol_key, v);
+}
+
+// A thread that exits with a volume selected stops using it
+static void release_volume(void *v) {
+    pthread_mutex_lock(&volumes_lock);
+    ((volume_t *) v)->users--;
+    pthread_mutex_unlock(&volumes_lock);
+}
+
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+static int pin_cpus;               // MFS_PIN_CPUS=1
+
+// Process-wide setup, done by the first mount
+static void engine_init(void) {
+    char *env = getenv("MFS_DIR_COMPACT");
+    compact_dirs = (env != NULL && atoi(env) > 0);
+    env = getenv("MFS_PLACEMENT");
+    placement_lowest = (env != NULL && strcmp(env, "lowest") == 0);
+    env = getenv("MFS_PIN_CPUS");
+    pin_cpus = (env != NULL && atoi(env) > 0);
+    env = getenv("MFS_CBT");
+    cbt_create = (env != NULL && atoi(env) > 0);
+
+    pthread_key_create(&dirty_key, free);
+    pthread_key_create(&events_key, free);
+    pthread_key_create(&vol_key, release_volume);
+    start_stats_dumper();
+    start_tracing();
+}
+
+int MFS_Mount(char *filename) {
+    pthread_once(&engine_once, engine_init);
+    volume_t *v = calloc(1, sizeof(volume_t));
+    if (v == NULL) {
+        return -1;
+    }
+    v->fd = -1;
+    v->cbt_fd = -1;
+    lock_init(v);
+
+    // Mounts are serialized: they are rare and share the startup timings
+    pthread_mutex_lock(&volumes_lock);
+    int id = 0;
+    while (id < MAX_VOLUMES && volumes[id] != NULL) {
+        id++;
+    }
+    volume_t *saved = vol;
+    vol = v;
+    int rc = (id < MAX_VOLUMES) ? load_volume(filename) : -1;
+    vol = saved;
+    if (rc == 0) {
+        v->id = id;
+        volumes[id] = v;
+        start_flusher(v);
+    }
+    pthread_mutex_unlock(&volumes_lock);
+
+    if (rc != 0) {
+        pthread_rwlock_destroy(&v->lock);
+        free(v->image_path);
+        free(v);
+        return -1;
+    }
+    return id;
+}
+
+int MFS_Use(int id) {
+    pthread_mutex_lock(&volumes_lock);
+    volume_t *v = (id >= 0 && id < MAX_VOLUMES) ? volumes[id] : NULL;
+    if (v != NULL) {
+        select_volume(v);
+    }
+    pthread_mutex_unlock(&volumes_lock);
+    if (v == NULL) {
+        return -1;
+    }
+
+    // Keep each volume's threads on one core so its metadata stays in that
+    // core's cache; volumes are spread round-robin over the online CPUs
+    if (pin_cpus) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(id % (ncpu > 0 ? ncpu : 1), &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    return 0;
+}
+
+// Refused while another thread has the volume selected. Otherwise it leaves
+// the table first, so no thread can select it again, and since nobody else
+// has it, no call on it is in progress or can start. It is released even if
+// the final commit fails, but then -1 tells the caller it may not be durable.
+int MFS_Unmount(int id) {
+    pthread_mutex_lock(&volumes_lock);
+    volume_t *v = (id >= 0 && id < MAX_VOLUMES) ? volumes[id] : NULL;
+    if (v == NULL || v->users > (vol == v)) {
+        pthread_mutex_unlock(&volumes_lock);
+        return -1;
+    }
+    volumes[id] = NULL;
+    if (vol == v) {
+        select_volume(NULL);
+    }
+    pthread_mutex_unlock(&volumes_lock);
+    pthread_rwlock_destroy(&v->lock);
+
+    volume_t *saved = vol;
+    vol = v;
+    int rc = 0;
+    if (v->fd != -1) {
+        rc = commit();
+        stop_flusher(v);
+        if (close(v->fd) != 0) {
+            rc = -1;
+        }
+    }
+    cbt_close();
+    if (v->map != NULL) {
+        munmap(v->map, v->map_len);
+    }
+    free_metadata();
+    free(v->image_path);
+    vol = saved;
+    free(v);
+    return rc;
+}
+
+int MFS_Init(char *filename, int port) {
+    // For local filesystem, we ignore the port parameter
+    int id = MFS_Mount(filename);
+    if (id < 0) {
+        return -1;
+    }
+    return MFS_Use(id);
+}
+
+int MFS_Stats(char *buffer, int nbytes) {
+    if (buffer == NULL || nbytes <= 0) {
+        return -1;
+    }
+    return stats_format(buffer, nbytes);
+}
+
+int MFS_TraceDump(char *path) {
+    if (path == NULL) {
+        return -1;
+    }
+    return trace_dump(path);
+}
+
+static int fs_lookup(int pinum, char *name) {
+
+    // Read the parent inode
+    inode_t parent_inode;
+    if (get_inode(pinum, &parent_inode) != 0) {
+        return -2;
+    }
+
+    if (parent_inode.type != UFS_DIRECTORY) {
+        return -3;
+    }
+
+    // Every directory entry is in the name index
+    return index_find(pinum, name);
+}
+
+static int fs_stat(int inum, MFS_Stat_t *m) {
+    if (inum < 0 || inum >= vol->superblock.num_inodes || m == NULL) {
+        return -1;
+    }
+
+    inode_t inode;
+    if (get_inode(inum, &inode) != 0) {
+        return -1;
+    }
+
+    m->type = inode.type;
+    m->size = inode.size;
+
+    return 0;
+}
+
+
+int get_inode(int inum, inode_t *inode) {
+    if (vol == NULL || inum < 0 || inum >= vol->superblock.num_inodes) {
+        return -1;
+    }
+
+    unsigned long t = trace_begin();
+    memcpy(inode, &vol->inode_table[inum], sizeof(inode_t));
+    trace_end(PH_INODE, t);
+
+    return 0;
+}
+
+// Updates the in-memory copy and writes it through to the image
+int put_inode(int inum, inode_t *inode) {
+    if (inum < 0 || inum >= vol->superblock.num_inodes) {
+        return -1;
+    }
+
+    off_t offset = (off_t) vol->superblock.inode_region_addr * UFS_BLOCK_SIZE + (off_t) inum * sizeof(inode_t);
+    if (disk_pwrite(inode, sizeof(inode_t), offset) != sizeof(inode_t)) {
+        return -1;
+    }
+    memcpy(&vol->inode_table[inum], inode, sizeof(inode_t));
+
+    return 0;
+}
+
+static bitmap_t *bitmap_at(int bitmap_start) {
+    return (bitmap_start == vol->inode_map.addr) ? &vol->inode_map : &vol->data_map;
+}
+
+int set_bitmap(int bitmap_start, int bitmap_len, int index, int value) {
+    bitmap_t *map = bitmap_at(bitmap_start);
+    if (index < 0 || index >= map->num_bits) {
+        return -1;
+    }
+
+    int word_index = index / 32;
+    unsigned int mask = 0x1u << (31 - index % 32);
+    unsigned int word = value ? (map->words[word_index] | mask) : (map->words[word_index] & ~mask);
+    if (word == map->words[word_index]) {
+        return 0;
+    }
+
+    off_t offset = (off_t) map->addr * UFS_BLOCK_SIZE + word_index * sizeof(unsigned int);
+    if (disk_pwrite(&word, sizeof(word), offset) != sizeof(word)) {
+        return -1;
+    }
+    map->words[word_index] = word;
+
+    int delta = value ? -1 : 1;
+    map->block_free[index / BITS_PER_BLOCK] += delta;
+    map->group_free[index / GROUP_BITS] += delta;
+    __atomic_store_n(map->gauge, *map->gauge + delta, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+// Walks the summary top-down: the first bitmap block with a free bit, then
+// the first group in it with a free bit, then the first non-full word. Full
+// regions are never scanned. Returns the lowest free bit at or after from.
+static int find_free_from(bitmap_t *map, int from) {
+    if (from < 0) {
+        from = 0;
+    }
+    for (int b = from / BITS_PER_BLOCK; b < map->len; b++) {
+        if (map->block_free[b] == 0) {
+            continue;
+        }
+        int g = b * GROUPS_PER_BLOCK;
+        if (g < from / GROUP_BITS) {
+            g = from / GROUP_BITS;
+        }
+        for (; g < (b + 1) * GROUPS_PER_BLOCK; g++) {
+            if (map->group_free[g] == 0) {
+                continue;
+            }
+            int w = g * GROUP_WORDS;
+            if (w < from / 32) {
+                w = from / 32;
+            }
+            for (; w < (g + 1) * GROUP_WORDS; w++) {
+                unsigned int word = map->words[w];
+                if (w == from / 32) {
+                    word |= ~(0xffffffffu >> (from % 32));  // ignore bits before from
+                }
+                STAT_ADD(bits_scanned, 32);
+                if (word != 0xffffffffu) {
+                    int index = w * 32 + __builtin_clz(~word);
+                    return (index < map->num_bits) ? index : -1;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+int find_free_bit(int bitmap_start, int bitmap_len, int num_bits) {
+    return find_free_from(bitmap_at(bitmap_start), 0);
+}
+
+// Sets or clears many bits at once. Each bitmap block that changes is
+// written back with a single pwrite instead of one write per bit.
+static int set_bits_bulk(bitmap_t *map, int *indexes, int count, int value) {
+    char *dirty = calloc(map->len, 1);
+    if (dirty == NULL) {
+        return -1;
+    }
+
+    int delta = value ? -1 : 1;
+    long changed = 0;
+    for (int i = 0; i < count; i++) {
+        int index = indexes[i];
+        if (index < 0 || index >= map->num_bits || bit_test(map, index) == (value != 0)) {
+            continue;
+        }
+        map->words[index / 32] ^= 0x1u << (31 - index % 32);
+        map->block_free[index / BITS_PER_BLOCK] += delta;
+        map->group_free[index / GROUP_BITS] += delta;
+        dirty[index / BITS_PER_BLOCK] = 1;
+        changed++;
+    }
+    __atomic_store_n(map->gauge, *map->gauge + delta * changed, __ATOMIC_RELAXED);
+
+    int rc = 0;
+    for (int b = 0; b < map->len; b++) {
+        if (dirty[b] && write_block(map->addr + b, map->words + b * (UFS_BLOCK_SIZE / sizeof(unsigned int))) != UFS_BLOCK_SIZE) {
+            rc = -1;
+        }
+    }
+    free(dirty);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Placement
+//
+// Allocation is goal-directed, in the spirit of FFS cylinder groups and the
+// Orlov allocator: the search for a free bit starts at a goal and wraps.
+//   - a directory's entries get their inodes from one inode-table block,
+//     starting with the directory's own; when it fills, the directory
+//     claims an empty block (exactly one bitmap word) and continues there.
+//     Listing a directory and stating its entries then touches few blocks.
+//   - a new directory's inode also starts an empty block if there is one;
+//     directories made in the root start in the inode group, and put their
+//     first block in the data group, with the most free space, which keeps
+//     unrelated trees apart
+//   - other directory blocks go right after the directory's (or its
+//     parent's) blocks, and file data after the file's previous block or
+//     near its directory
+// MFS_PLACEMENT=lowest turns goals off and always takes the lowest free bit.
+// ---------------------------------------------------------------------------
+
+_Static_assert(INODES_PER_BLOCK == 32, "one inode bitmap word per inode-table block");
+
+// First free bit at or after goal, wrapping to the start of the map
+static int find_free_near(bitmap_t *map, int goal) {
+    int index = (!placement_lowest && goal > 0 && goal < map->num_bits) ? find_free_from(map, goal) : -1;
+    return (index != -1) ? index : find_free_from(map, 0);
+}
+
+// First inode of a completely free inode-table block at or after goal, or -1
+static int find_free_inode_block(int goal) {
+    bitmap_t *map = &vol->inode_map;
+    int words = map->num_bits / 32;
+    if (words == 0) {
+        return -1;
+    }
+    for (int i = 0; i < words; i++) {
+        int w = (goal / 32 + i) % words;
+        if (map->group_free[w * 32 / GROUP_BITS] < 32) {
+            continue;
+        }
+        STAT_ADD(bits_scanned, 32);
+        if (map->words[w] == 0) {
+            return w * 32;
+        }
+    }
+    return -1;
+}
+
+// Group (of GROUP_BITS bits) with the most clear bits
+static int emptiest_group(bitmap_t *map) {
+    int groups = (map->num_bits + GROUP_BITS - 1) / GROUP_BITS;
+    int best = 0;
+    for (int g = 1; g < groups; g++) {
+        if (map->group_free[g] > map->group_free[best]) {
+            best = g;
+        }
+    }
+    return best;
+}
+
+static int inode_goal(int pinum, int type) {
+    if (placement_lowest || pinum < 0 || pinum >= vol->superblock.num_inodes) {
+        return 0;
+    }
+    if (type == UFS_DIRECTORY) {
+        int goal = (pinum == 0) ? emptiest_group(&vol->inode_map) * GROUP_BITS
+                                : pinum - pinum % INODES_PER_BLOCK;
+        int fresh = find_free_inode_block(goal);
+        return (fresh != -1) ? fresh : goal;
+    }
+
+    int goal = vol->child_block[pinum];
+    if (goal < 0) {
+        goal = pinum - pinum % INODES_PER_BLOCK;
+    }
+    if (vol->inode_map.words[goal / 32] == 0xffffffffu) {
+        int fresh = find_free_inode_block(goal);
+        if (fresh != -1) {
+            goal = fresh;
+        }
+    }
+    vol->child_block[pinum] = goal;
+    return goal;
+}
+
+// Where a new directory's first block goes
+static int dir_data_goal(int pinum, inode_t *parent) {
+    if (pinum == 0 && !placement_lowest) {
+        return vol->superblock.data_region_addr + emptiest_group(&vol->data_map) * GROUP_BITS;
+    }
+    return parent->direct[0];
+}
+
+static int allocate_inode_near(int pinum, int type) {
+    unsigned long t = trace_begin();
+    int inum = find_free_near(&vol->inode_map, inode_goal(pinum, type));
+    if (inum == -1) return -1;
+    if (set_bitmap(vol->superblock.inode_bitmap_addr, vol->superblock.inode_bitmap_len, inum, 1) == -1) return -1;
+    STAT_ADD(inode_allocs, 1);
+    trace_end(PH_ALLOC, t);
+    return inum;
+}
+
+int allocate_inode() {
+    return allocate_inode_near(-1, UFS_REGULAR_FILE);
+}
+
+// goal is an absolute block number, or -1 for none
+static int allocate_data_near(int goal) {
+    unsigned long t = trace_begin();
+    int block_num = find_free_near(&vol->data_map, goal - vol->superblock.data_region_addr);
+    if (block_num == -1) return -1;
+    if (set_bitmap(vol->superblock.data_bitmap_addr, vol->superblock.data_bitmap_len, block_num, 1) == -1) return -1;
+    STAT_ADD(block_allocs, 1);
+    trace_end(PH_ALLOC, t);
+    return vol->superblock.data_region_addr + block_num;
+}
+
+int allocate_data_block() {
+    return allocate_data_near(-1);
+}
+
+// Block to place a file's data near when it has none yet: its directory's
+static int data_goal_for(int inum) {
+    int pinum = (inum >= 0 && inum < vol->superblock.num_inodes) ? vol->parent_of[inum] : -1;
+    return (pinum >= 0) ? (int) vol->inode_table[pinum].direct[0] : -1;
+}
+
+// Allocates count consecutive data blocks, searching from goal (absolute,
+// or -1) and then from the start; returns the first, or -1 if no free run
+// is long enough
+static int allocate_data_run(int count, int goal) {
+    int from = (goal > 0 && !placement_lowest) ? goal - vol->superblock.data_region_addr : 0;
+    if (from < 0 || from >= vol->data_map.num_bits) {
+        from = 0;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        int start = find_free_from(&vol->data_map, pass ? 0 : from);
+        while (start != -1 && start + count <= vol->data_map.num_bits) {
+            int len = 1;
+            while (len < count && !bit_test(&vol->data_map, start + len)) {
+                len++;
+            }
+            if (len == count) {
+                int indexes[DIRECT_PTRS];
+                for (int i = 0; i < count; i++) {
+                    indexes[i] = start + i;
+                }
+                if (set_bits_bulk(&vol->data_map, indexes, count, 1) != 0) {
+                    return -1;
+                }
+                STAT_ADD(block_allocs, count);
+                return vol->superblock.data_region_addr + start;
+            }
+            start = find_free_from(&vol->data_map, start + len + 1);
+        }
+        if (from == 0) {
+            break;
+        }
+    }
+    return -1;
+}
+
+int free_data_block(int block_num) {
+    int rel_block_num = block_num - vol->superblock.data_region_addr;
+    STAT_ADD(block_frees, 1);
+    return set_bitmap(vol->superblock.data_bitmap_addr, vol->superblock.data_bitmap_len, rel_block_num, 0);
+}
+
+// ---------------------------------------------------------------------------
+// Directory slots
+//
+// A directory grows a block at a time, up to DIRECT_PTRS blocks of
+// ENTRIES_PER_BLOCK entries. For each directory touched since boot we keep a
+// bitmap of used slots and a free count per block, built from its blocks the
+// first time they are needed, so an insert finds a slot without rescanning
+// the directory. A directory's size is the end of its last used slot, as the
+// README defines it.
+// ---------------------------------------------------------------------------
+
+static dir_slots_t *dir_slots(int inum, inode_t *dir) {
+    if (vol->dir_slot_cache[inum] != NULL) {
+        return vol->dir_slot_cache[inum];
+    }
+
+    dir_slots_t *d = calloc(1, sizeof(dir_slots_t));
+    if (d == NULL) {
+        return NULL;
+    }
+    dir_ent_t entries[ENTRIES_PER_BLOCK];
+    for (int i = 0; i < DIRECT_PTRS; i++) {
+        if (dir->direct[i] == -1) {
+            d->block_free[i] = -1;
+            continue;
+        }
+        if (read_block(dir->direct[i], entries) != UFS_BLOCK_SIZE) {
+            free(d);
+            return NULL;
+        }
+        for (int j = 0; j < ENTRIES_PER_BLOCK; j++) {
+            int slot = i * ENTRIES_PER_BLOCK + j;
+            if (entries[j].inum != -1) {
+                d->used[slot / 32] |= 0x1u << (31 - slot % 32);
+                d->live++;
+            } else {
+                d->block_free[i]++;
+            }
+        }
+    }
+    vol->dir_slot_cache[inum] = d;
+    return d;
+}
+
+static void dir_slots_drop(int inum) {
+    free(vol->dir_slot_cache[inum]);
+    vol->dir_slot_cache[inum] = NULL;
+}
+
+static void dir_slot_mark(dir_slots_t *d, int slot, int used) {
+    unsigned int mask = 0x1u << (31 - slot % 32);
+    if (((d->used[slot / 32] & mask) != 0) == (used != 0)) {
+        return;
+    }
+    d->used[slot / 32] ^= mask;
+    d->block_free[slot / ENTRIES_PER_BLOCK] += used ? -1 : 1;
+    d->live += used ? 1 : -1;
+}
+
+// End of the last used slot, in bytes
+static int dir_size(dir_slots_t *d) {
+    for (int w = DIR_SLOTS / 32 - 1; w >= 0; w--) {
+        if (d->used[w] != 0) {
+            int last = w * 32 + 31 - __builtin_ctz(d->used[w]);
+            return (last + 1) * sizeof(dir_ent_t);
+        }
+    }
+    return 0;
+}
+
+// Returns a free slot in dir, adding a block to it if all are taken. The
+// caller must write dir back if direct[] changed.
+static int dir_find_slot(dir_slots_t *d, inode_t *dir) {
+    for (int i = 0; i < DIRECT_PTRS; i++) {
+        if (d->block_free[i] <= 0) {
+            continue;
+        }
+        for (int w = i * ENTRIES_PER_BLOCK / 32; w < (i + 1) * ENTRIES_PER_BLOCK / 32; w++) {
+            if (d->used[w] != 0xffffffffu) {
+                return w * 32 + __builtin_clz(~d->used[w]);
+            }
+        }
+    }
+
+    for (int i = 0; i < DIRECT_PTRS; i++) {
+        if (dir->direct[i] != -1) {
+            continue;
+        }
+        int block = allocate_data_near((i > 0) ? (int) dir->direct[i - 1] + 1 : -1);
+        if (block == -1) {
+            return -1;
+        }
+        dir_ent_t entries[ENTRIES_PER_BLOCK];
+        memset(entries, 0, sizeof(entries));
+        for (int j = 0; j < ENTRIES_PER_BLOCK; j++) {
+            entries[j].inum = -1;
+        }
+        if (write_block(block, entries) != UFS_BLOCK_SIZE) {
+            free_data_block(block);
+            return -1;
+        }
+        dir->direct[i] = block;
+        d->block_free[i] = ENTRIES_PER_BLOCK;
+        return i * ENTRIES_PER_BLOCK;
+    }
+
+    return -1;  // Directory is at its maximum size
+}
+
+// Packs the live entries of a sparse directory into as few blocks as they
+// need and releases the rest. Names keep their inode numbers, so the name
+// index is unaffected.
+static int dir_compact(int inum) {
+    inode_t dir;
+    if (get_inode(inum, &dir) != 0 || dir.type != UFS_DIRECTORY) {
+        return -1;
+    }
+    dir_slots_t *d = dir_slots(inum, &dir);
+    if (d == NULL) {
+        return -1;
+    }
+
+    int allocated[DIRECT_PTRS];
+    int nblocks = 0;
+    for (int i = 0; i < DIRECT_PTRS; i++) {
+        if (dir.direct[i] != -1) {
+            allocated[nblocks++] = i;
+        }
+    }
+    int needed = (d->live + ENTRIES_PER_BLOCK - 1) / ENTRIES_PER_BLOCK;
+    if (needed < 1) {
+        needed = 1;
+    }
+    if (needed >= nblocks) {
+        return 0;
+    }
+
+    dir_ent_t *packed = malloc(nblocks * UFS_BLOCK_SIZE);
+    dir_ent_t entries[ENTRIES_PER_BLOCK];
+    if (packed == NULL) {
+        return -1;
+    }
+    int n = 0;
+    for (int b = 0; b < nblocks; b++) {
+        if (read_block(dir.direct[allocated[b]], entries) != UFS_BLOCK_SIZE) {
+            free(packed);
+            return -1;
+        }
+        for (int j = 0; j < ENTRIES_PER_BLOCK; j++) {
+            if (entries[j].inum != -1) {
+                packed[n++] = entries[j];
+            }
+        }
+    }
+    for (; n < needed * ENTRIES_PER_BLOCK; n++) {
+        memset(&packed[n], 0, sizeof(dir_ent_t));
+        packed[n].inum = -1;
+    }
+
+    int rc = 0;
+    for (int b = 0; b < needed && rc == 0; b++) {
+        if (write_block(dir.direct[allocated[b]], &packed[b * ENTRIES_PER_BLOCK]) != UFS_BLOCK_SIZE) {
+            rc = -1;
+        }
+    }
+    free(packed);
+    if (rc != 0) {
+        return -1;
+    }
+
+    for (int b = needed; b < nblocks; b++) {
+        free_data_block(dir.direct[allocated[b]]);
+        dir.direct[allocated[b]] = -1;
+    }
+    dir_slots_drop(inum);
+    d = dir_slots(inum, &dir);
+    dir.size = (d != NULL) ? dir_size(d) : dir.size;
+    return put_inode(inum, &dir);
+}
+
+// With MFS_DIR_COMPACT set, shrink a directory once its entries would fit
+// in half of its blocks
+static void maybe_compact(int inum) {
+    if (!compact_dirs || vol->dir_slot_cache[inum] == NULL) {
+        return;
+    }
+    dir_slots_t *d = vol->dir_slot_cache[inum];
+    int nblocks = 0;
+    for (int i = 0; i < DIRECT_PTRS; i++) {
+        nblocks += (d->block_free[i] >= 0);
+    }
+    int needed = (d->live + ENTRIES_PER_BLOCK - 1) / ENTRIES_PER_BLOCK;
+    if (nblocks > 1 && needed <= nblocks / 2) {
+        dir_compact(inum);
+    }
+}
+
+static int fs_read(int inum, char *buffer, int offset, int nbytes) {
+    if (inum < 0 || buffer == NULL || offset < 0 || nbytes < 0) {
+        return -1;
+    }
+
+    inode_t inode;
+    if (get_inode(inum, &inode) != 0) {
+        return -1;
+    }
+
+    if (offset >= inode.size) {
+        return 0;  // Nothing to read
+    }
+
+    int bytes_to_read = (offset + nbytes > inode.size) ? (inode.size - offset) : nbytes;
+    int bytes_read = 0;
+
+    while (bytes_read < bytes_to_read) {
+        int block_index = (offset + bytes_read) / UFS_BLOCK_SIZE;
+        int block_offset = (offset + bytes_read) % UFS_BLOCK_SIZE;
+
+        if (block_index >= DIRECT_PTRS) {
+            break;  // We don't support indirect blocks in this implementation
+        }
+
+        int data_block = inode.direct[block_index];
+        if (data_block == -1) {
+            break;  // Reached the end of allocated blocks
+        }
+
+        char block_buffer[UFS_BLOCK_SIZE];
+        if (read_block(data_block, block_buffer) != UFS_BLOCK_SIZE) {
+            return -1;
+        }
+
+        int bytes_to_copy = UFS_BLOCK_SIZE - block_offset;
+        if (bytes_to_copy > bytes_to_read - bytes_read) {
+            bytes_to_copy = bytes_to_read - bytes_read;
+        }
+
+        memcpy(buffer + bytes_read, block_buffer + block_offset, bytes_to_copy);
+        bytes_read += bytes_to_copy;
+    }
+
+    return bytes_read;
+}
+
+// Same bytes as fs_read, but described by iovecs pointing into the mapped
+// image instead of copied out. Blocks that are adjacent on disk share one
+// entry. Returns the number of entries filled (0 at end of file), or -1 if
+// the volume is not mapped or iovcnt is too small.
+static int fs_read_map(int inum, int offset, int nbytes, struct iovec *iov, int iovcnt) {
+    inode_t inode;
+    if (vol == NULL || vol->map == NULL || iov == NULL || offset < 0 || nbytes < 0 ||
+        get_inode(inum, &inode) != 0) {
+        return -1;
+    }
+    // Compared as nbytes > size - offset so a huge nbytes cannot overflow
+    int end = (nbytes > inode.size - offset) ? inode.size : offset + nbytes;
+    int used = 0;
+    unsigned long t = trace_begin();
+    for (int pos = offset; pos < end; ) {
+        int block_index = pos / UFS_BLOCK_SIZE;
+        int block_offset = pos % UFS_BLOCK_SIZE;
+        if (block_index >= DIRECT_PTRS || inode.direct[block_index] == -1) {
+            break;  // Same stopping rule as fs_read
+        }
+        int len = UFS_BLOCK_SIZE - block_offset;
+        if (len > end - pos) {
+            len = end - pos;
+        }
+        // A corrupt pointer is refused as read_block refuses it, rather than
+        // handed out as an address outside the mapping
+        off_t at = (off_t) inode.direct[block_index] * UFS_BLOCK_SIZE + block_offset;
+        if (!block_ok(inode.direct[block_index]) || at + len > (off_t) vol->map_len) {
+            trace_end(PH_BLOCK_IO, t);
+            return -1;
+        }
+        char *base = vol->map + at;
+        if (used > 0 && (char *) iov[used - 1].iov_base + iov[used - 1].iov_len == base) {
+            iov[used - 1].iov_len += len;
+        } else if (used < iovcnt) {
+            iov[used].iov_base = base;
+            iov[used].iov_len = len;
+            used++;
+        } else {
+            trace_end(PH_BLOCK_IO, t);
+            return -1;
+        }
+        STAT_ADD(bytes_mapped, len);
+        pos += len;
+    }
+    trace_end(PH_BLOCK_IO, t);
+    return used;
+}
+
+static int fs_write(int inum, char *buffer, int offset, int nbytes) {
+    if (inum < 0 || buffer == NULL || offset < 0 || nbytes < 0) {
+        return -1;
+    }
+
+    inode_t inode;
+    if (get_inode(inum, &inode) != 0) {
+        return -1;
+    }
+
+    if (inode.type != UFS_REGULAR_FILE) {
+        return -1;  // Can only write to regular files
+    }
+
+    int bytes_written = 0;
+
+    while (bytes_written < nbytes) {
+        int block_index = (offset + bytes_written) / UFS_BLOCK_SIZE;
+        int block_offset = (offset + bytes_written) % UFS_BLOCK_SIZE;
+
+        if (block_index >= DIRECT_PTRS) {
+            break;  // We don't support indirect blocks in this implementation
+        }
+
+        if (inode.direct[block_index] == -1) {
+            // Allocate a new block, after the previous one if possible
+            int goal = (block_index > 0 && inode.direct[block_index - 1] != -1) ?
+                       (int) inode.direct[block_index - 1] + 1 : data_goal_for(inum);
+            int new_block = allocate_data_near(goal);
+            if (new_block == -1) {
+                return bytes_written;  // No more free blocks
+            }
+            inode.direct[block_index] = new_block;
+        }
+
+        char block_buffer[UFS_BLOCK_SIZE];
+        if (read_block(inode.direct[block_index], block_buffer) != UFS_BLOCK_SIZE) {
+            return -1;
+        }
+
+        int bytes_to_copy = UFS_BLOCK_SIZE - block_offset;
+        if (bytes_to_copy > nbytes - bytes_written) {
+            bytes_to_copy = nbytes - bytes_written;
+        }
+
+        memcpy(block_buffer + block_offset, buffer + bytes_written, bytes_to_copy);
+
+        if (write_block(inode.direct[block_index], block_buffer) != UFS_BLOCK_SIZE) {
+            return -1;
+        }
+
+        bytes_written += bytes_to_copy;
+    }
+
+    // Update inode size if necessary
+    if (offset + bytes_written > inode.size) {
+        inode.size = offset + bytes_written;
+    }
+    
+    if (put_inode(inum, &inode) != 0) {
+        return -1;
+    }
+
+    return bytes_written;
+}
+
+static int fs_creat(int pinum, int type, char *name) {
+    if (pinum < 0 || (type != UFS_REGULAR_FILE && type != UFS_DIRECTORY) || name == NULL || strlen(name) > 27) {
+        return -1;
+    }
+
+    inode_t parent_inode;
+    if (get_inode(pinum, &parent_inode) != 0 || parent_inode.type != UFS_DIRECTORY) {
+        return -2;
+    }
+
+    // Check if the file/directory already exists
+    int existing_inum = fs_lookup(pinum, name);
+    if (existing_inum >= 0) {
+        return 0;  // File/directory already exists, return success
+    }
+
+    // Allocate new inode
+    int new_inum = allocate_inode_near(pinum, type);
+    if (new_inum == -1) {
+        return -3;  // No free inodes
+    }
+
+    // Initialize new inode
+    inode_t new_inode;
+    memset(&new_inode, 0, sizeof(inode_t));
+    new_inode.type = type;
+    new_inode.size = (type == UFS_DIRECTORY) ? 2 * sizeof(dir_ent_t) : 0;
+    for (int i = 0; i < DIRECT_PTRS; i++) {
+        new_inode.direct[i] = -1;
+    }
+
+    // For directories, allocate the first block and add . and .. entries
+    if (type == UFS_DIRECTORY) {
+        int new_block = allocate_data_near(dir_data_goal(pinum, &parent_inode));
+        if (new_block == -1) {
+            set_bitmap(vol->superblock.inode_bitmap_addr, vol->superblock.inode_bitmap_len, new_inum, 0);
+            return -5;
+        }
+        new_inode.direct[0] = new_block;
+
+        // The rest of the block must read as unused slots
+        dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+        memset(entries, 0, sizeof(entries));
+        for (int j = 2; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
+            entries[j].inum = -1;
+        }
+        strcpy(entries[0].name, ".");
+        entries[0].inum = new_inum;
+        strcpy(entries[1].name, "..");
+        entries[1].inum = pinum;
+
+        if (write_block(new_block, entries) != UFS_BLOCK_SIZE) {
+            set_bitmap(vol->superblock.inode_bitmap_addr, vol->superblock.inode_bitmap_len, new_inum, 0);
+            free_data_block(new_block);
+            return -6;
+        }
+    }
+
+    // Write new inode
+    if (put_inode(new_inum, &new_inode) != 0) {
+        set_bitmap(vol->superblock.inode_bitmap_addr, vol->superblock.inode_bitmap_len, new_inum, 0);
+        if (type == UFS_DIRECTORY) {
+            free_data_block(new_inode.direct[0]);
+        }
+        return -7;
+    }
+
+    // Add entry to parent directory, growing it if every slot is taken
+    dir_slots_t *slots = dir_slots(pinum, &parent_inode);
+    int slot = (slots != NULL) ? dir_find_slot(slots, &parent_inode) : -1;
+    if (slot < 0) {
+        free_inode(new_inum);
+        if (type == UFS_DIRECTORY) {
+            free_data_block(new_inode.direct[0]);
+        }
+        return -1;  // Parent directory is full
+    }
+
+    int block = parent_inode.direct[slot / ENTRIES_PER_BLOCK];
+    dir_ent_t entries[ENTRIES_PER_BLOCK];
+    if (read_block(block, entries) != UFS_BLOCK_SIZE) {
+        return -1;
+    }
+    dir_ent_t *entry = &entries[slot % ENTRIES_PER_BLOCK];
+    memset(entry->name, 0, sizeof(entry->name));
+    strcpy(entry->name, name);
+    entry->inum = new_inum;
+    if (write_block(block, entries) != UFS_BLOCK_SIZE) {
+        return -1;
+    }
+
+    dir_slot_mark(slots, slot, 1);
+    parent_inode.size = dir_size(slots);
+    if (put_inode(pinum, &parent_inode) != 0) {
+        return -1;
+    }
+    index_add_entry(pinum, name, new_inum, type);
+    return 0;
+}
+
+// Add this function to free an inode
+int free_inode(int inum) {
+    STAT_ADD(inode_frees, 1);
+    return set_bitmap(vol->superblock.inode_bitmap_addr, vol->superblock.inode_bitmap_len, inum, 0);
+}
+
+// Recursive function to remove all contents of a directory
+int remove_directory_contents(int inum) {
+    inode_t inode;
+    if (get_inode(inum, &inode) != 0) {
+        return -9;
+    }
+
+    for (int i = 0; i < DIRECT_PTRS && inode.direct[i] != -1; i++) {
+        dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+        if (read_block(inode.direct[i], entries) != UFS_BLOCK_SIZE) {
+            return -8;
+        }
+
+        for (int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
+            if (entries[j].inum != -1 && 
+                strcmp(entries[j].name, ".") != 0 && 
+                strcmp(entries[j].name, "..") != 0) {
+                
+                inode_t child_inode;
+                if (get_inode(entries[j].inum, &child_inode) != 0) {
+                    return -7;
+                }
+
+                if (child_inode.type == UFS_DIRECTORY) {
+                    if (remove_directory_contents(entries[j].inum) != 0) {
+                        return -1;
+                    }
+                }
+
+                // Free all data blocks
+                for (int k = 0; k < DIRECT_PTRS && child_inode.direct[k] != -1; k++) {
+                    if (free_data_block(child_inode.direct[k]) != 0) {
+                        return -1;
+                    }
+                }
+
+                // Free the inode
+                if (free_inode(entries[j].inum) != 0) {
+                    return -1;
+                }
+                index_remove_entry(inum, entries[j].name, entries[j].inum, child_inode.type);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int fs_unlink(int pinum, char *name) {
+    if (pinum < 0 || name == NULL || strlen(name) > 27) {
+        return -2;
+    }
+
+    inode_t parent_inode;
+    if (get_inode(pinum, &parent_inode) != 0 || parent_inode.type != UFS_DIRECTORY) {
+        return -3;
+    }
+
+    int target_inum = -1;
+    int target_block = -1;
+    int target_entry = -1;
+
+    // Find the entry to be removed
+    for (int i = 0; i < DIRECT_PTRS && parent_inode.direct[i] != -1; i++) {
+        dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+        if (read_block(parent_inode.direct[i], entries) != UFS_BLOCK_SIZE) {
+            return -4;
+        }
+
+        for (int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
+            if (entries[j].inum != -1 && strcmp(entries[j].name, name) == 0) {
+                target_inum = entries[j].inum;
+                target_block = i;
+                target_entry = j;
+                break;
+            }
+        }
+
+        if (target_inum != -1) break;
+    }
+
+    if (target_inum == -1) {
+        return 0;  // File or directory not found, which is considered success
+    }
+
+    inode_t target_inode;
+    if (get_inode(target_inum, &target_inode) != 0) {
+        return -5;
+    }
+
+    // If it's a directory, make sure it's empty (except for . and ..)
+    if (target_inode.type == UFS_DIRECTORY) {
+        if (target_inode.size > 2 * sizeof(dir_ent_t)) {
+            return -1;  // Directory not empty
+        }
+        
+        // Remove contents (this is just a safety measure, as the directory should be empty)
+        if (remove_directory_contents(target_inum) != 0) {
+            return -1;
+        }
+    }
+
+    // Free all data blocks
+    for (int i = 0; i < DIRECT_PTRS && target_inode.direct[i] != -1; i++) {
+        if (free_data_block(target_inode.direct[i]) != 0) {
+            return -1;
+        }
+    }
+
+    // Free the inode
+    if (free_inode(target_inum) != 0) {
+        return -1;
+    }
+
+    // Remove the entry from the parent directory
+    dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+    if (read_block(parent_inode.direct[target_block], entries) != UFS_BLOCK_SIZE) {
+        return -1;
+    }
+
+    entries[target_entry].inum = -1;  // Mark the entry as unused
+    memset(entries[target_entry].name, 0, 28);  // Clear the name
+
+    if (write_block(parent_inode.direct[target_block], entries) != UFS_BLOCK_SIZE) {
+        return -1;
+    }
+    index_remove_entry(pinum, name, target_inum, target_inode.type);
+
+    if (target_inode.type == UFS_DIRECTORY) {
+        dir_slots_drop(target_inum);
+    }
+
+    // Update parent directory size
+    dir_slots_t *slots = dir_slots(pinum, &parent_inode);
+    if (slots == NULL) {
+        return -1;
+    }
+    dir_slot_mark(slots, target_block * ENTRIES_PER_BLOCK + target_entry, 0);
+    parent_inode.size = dir_size(slots);
+    if (put_inode(pinum, &parent_inode) != 0) {
+        return -1;
+    }
+    maybe_compact(pinum);
+
+    return 0;
+}
+
+// A growable array of ints
+typedef struct {
+    int *items;
+    int count;
+    int cap;
+} int_list_t;
+
+static int list_push(int_list_t *l, int value) {
+    if (l->count == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 256;
+        int *items = realloc(l->items, cap * sizeof(int));
+        if (items == NULL) {
+            return -1;
+        }
+        l->items = items;
+        l->cap = cap;
+    }
+    l->items[l->count++] = value;
+    return 0;
+}
+
+// Removes name from pinum and, if it is a directory, everything below it.
+// The subtree is walked with an explicit stack, freed inodes and blocks are
+// collected, and both bitmaps are then updated in bulk.
+static int fs_remove_tree(int pinum, char *name) {
+    if (pinum < 0 || name == NULL || strlen(name) > 27 ||
+        strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return -2;
+    }
+
+    inode_t parent_inode;
+    if (get_inode(pinum, &parent_inode) != 0 || parent_inode.type != UFS_DIRECTORY) {
+        return -3;
+    }
+
+    int target_inum = index_find(pinum, name);
+    if (target_inum < 0) {
+        return 0;  // Not there, same as MFS_Unlink
+    }
+
+    // Unhook the subtree from its parent first, so a crash part way through
+    // leaves leaked space (which fsck -r reclaims) rather than dangling names
+    dir_slots_t *slots = dir_slots(pinum, &parent_inode);
+    if (slots == NULL) {
+        return -1;
+    }
+    int found = 0;
+    dir_ent_t entries[ENTRIES_PER_BLOCK];
+    for (int i = 0; i < DIRECT_PTRS && !found; i++) {
+        if (parent_inode.direct[i] == -1) {
+            continue;
+        }
+        if (read_block(parent_inode.direct[i], entries) != UFS_BLOCK_SIZE) {
+            return -4;
+        }
+        for (int j = 0; j < ENTRIES_PER_BLOCK; j++) {
+            if (entries[j].inum == target_inum && strcmp(entries[j].name, name) == 0) {
+                entries[j].inum = -1;
+                memset(entries[j].name, 0, sizeof(entries[j].name));
+                if (write_block(parent_inode.direct[i], entries) != UFS_BLOCK_SIZE) {
+                    return -4;
+                }
+                dir_slot_mark(slots, i * ENTRIES_PER_BLOCK + j, 0);
+                found = 1;
+                break;
+            }
+        }
+    }
+    if (!found) {
+        return -4;
+    }
+    parent_inode.size = dir_size(slots);
+    if (put_inode(pinum, &parent_inode) != 0) {
+        return -1;
+    }
+    index_remove(pinum, name);
+    vol->parent_of[target_inum] = -1;
+
+    int_list_t stack = {0}, inodes = {0}, blocks = {0};
+    int rc = list_push(&stack, target_inum);
+
+    while (rc == 0 && stack.count > 0) {
+        int inum = stack.items[--stack.count];
+        inode_t inode;
+        if (get_inode(inum, &inode) != 0) {
+            continue;
+        }
+        rc |= list_push(&inodes, inum);
+        if (inode.type == UFS_DIRECTORY) {
+            dir_slots_drop(inum);
+        }
+
+        for (int i = 0; i < DIRECT_PTRS && rc == 0; i++) {
+            if (inode.direct[i] == -1) {
+                continue;
+            }
+            rc |= list_push(&blocks, inode.direct[i] - vol->superblock.data_region_addr);
+
+            if (inode.type != UFS_DIRECTORY || read_block(inode.direct[i], entries) != UFS_BLOCK_SIZE) {
+                continue;
+            }
+            for (int j = 0; j < ENTRIES_PER_BLOCK; j++) {
+                dir_ent_t *e = &entries[j];
+                if (e->inum < 0 || e->inum >= vol->superblock.num_inodes) {
+                    continue;
+                }
+                index_remove(inum, e->name);
+                if (strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0) {
+                    vol->parent_of[e->inum] = -1;
+                    rc |= list_push(&stack, e->inum);
+                }
+            }
+        }
+    }
+
+    if (rc == 0) {
+        rc = set_bits_bulk(&vol->data_map, blocks.items, blocks.count, 0);
+    }
+    if (rc == 0) {
+        rc = set_bits_bulk(&vol->inode_map, inodes.items, inodes.count, 0);
+    }
+    STAT_ADD(block_frees, blocks.count);
+    STAT_ADD(inode_frees, inodes.count);
 
-    // Check if the file/directory already exists
-    int existing_inum = MFS_Lookup(pinum, name);
-    if (existing_inum >= 0) {
-        return 0;  // File/directory already exists, return success
+    free(stack.items);
+    free(inodes.items);
+    free(blocks.items);
+    if (rc == 0) {
+        maybe_compact(pinum);
     }
+    return (rc == 0) ? 0 : -1;
+}
 
-    // Allocate new inode
-    int new_inum = allocate_inode();
-    if (new_inum == -1) {
-        return -3;  // No free inodes
+// Copies nbytes of src starting at offset into the regular file name in
+// dst_pinum (created if needed, replaced if it exists), starting at byte 0.
+// nbytes < 0 means "to the end of src". Destination blocks are allocated as
+// one contiguous run where possible. When offset is block aligned, blocks are
+// copied inside the image with copy_file_range, one call per run of blocks
+// that are contiguous on both sides; otherwise the range is read once and
+// written with one pwrite per destination run.
+// Frees the data blocks listed in blocks[0..count)
+static int release_blocks(unsigned int *blocks, int count) {
+    int indexes[DIRECT_PTRS];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (blocks[i] != -1) {
+            indexes[n++] = blocks[i] - vol->superblock.data_region_addr;
+        }
     }
+    STAT_ADD(block_frees, n);
+    return (n > 0) ? set_bits_bulk(&vol->data_map, indexes, n, 0) : 0;
+}
 
-    // Initialize new inode
-    inode_t new_inode;
-    memset(&new_inode, 0, sizeof(inode_t));
-    new_inode.type = type;
-    new_inode.size = (type == UFS_DIRECTORY) ? 2 * sizeof(dir_ent_t) : 0;
-    for (int i = 0; i < DIRECT_PTRS; i++) {
-        new_inode.direct[i] = -1;
+static int fs_copy(int src_inum, int dst_pinum, char *name, int offset, int nbytes) {
+    inode_t src;
+    if (get_inode(src_inum, &src) != 0 || src.type != UFS_REGULAR_FILE || offset < 0) {
+        return -1;
     }
+    int end = (nbytes < 0 || nbytes > src.size - offset) ? src.size : offset + nbytes;
+    int len = (end > offset) ? end - offset : 0;
+    int nblocks = (len + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
 
-    // For directories, allocate the first block and add . and .. entries
-    if (type == UFS_DIRECTORY) {
-        int new_block = allocate_data_block();
-        if (new_block == -1) {
-            set_bitmap(superblock.inode_bitmap_addr, superblock.inode_bitmap_len, new_inum, 0);
-            return -5;
+    int rc = fs_creat(dst_pinum, UFS_REGULAR_FILE, name);
+    if (rc < 0) {
+        return rc;
+    }
+    int dst_inum = index_find(dst_pinum, name);
+    inode_t dst;
+    if (dst_inum < 0 || dst_inum == src_inum || get_inode(dst_inum, &dst) != 0 || dst.type != UFS_REGULAR_FILE) {
+        return -1;
+    }
+
+    // Replacing an existing file (or retrying a copy): the new blocks are
+    // filled and the inode switched to them before the old ones are freed,
+    // so running out of space or failing to copy leaves the file as it was
+    unsigned int old[DIRECT_PTRS];
+    memcpy(old, dst.direct, sizeof(old));
+    unsigned int fresh[DIRECT_PTRS];
+    memset(fresh, 0xff, sizeof(fresh));
+    int goal = data_goal_for(dst_inum);
+    int first = (nblocks > 0) ? allocate_data_run(nblocks, goal) : -1;
+    for (int k = 0; k < nblocks; k++) {
+        fresh[k] = (first != -1) ? first + k : allocate_data_near(k > 0 ? (int) fresh[k - 1] + 1 : goal);
+        if (fresh[k] == -1) {
+            release_blocks(fresh, k);
+            return -1;
         }
-        new_inode.direct[0] = new_block;
+    }
 
-        dir_ent_t entries[2];
-        strcpy(entries[0].name, ".");
-        entries[0].inum = new_inum;
-        strcpy(entries[1].name, "..");
-        entries[1].inum = pinum;
+    if (offset % UFS_BLOCK_SIZE == 0) {
+        char zeros[UFS_BLOCK_SIZE] = {0};
+        int base = offset / UFS_BLOCK_SIZE;
+        for (int k = 0; k < nblocks && rc == 0; ) {
+            unsigned int from = src.direct[base + k];
+            if (from == -1) {
+                rc = (write_block(fresh[k], zeros) == UFS_BLOCK_SIZE) ? 0 : -1;
+                k++;
+                continue;
+            }
+            int run = 1;
+            while (k + run < nblocks &&
+                   src.direct[base + k + run] == from + run &&
+                   fresh[k + run] == fresh[k] + run) {
+                run++;
+            }
+            if (!block_ok(from) || !block_ok(from + run - 1)) {
+                rc = -1;
+                break;
+            }
+            unsigned long t = trace_begin();
+            rc = disk_copy((off_t) from * UFS_BLOCK_SIZE, (off_t) fresh[k] * UFS_BLOCK_SIZE,
+                           (size_t) run * UFS_BLOCK_SIZE);
+            trace_end(PH_BLOCK_IO, t);
+            k += run;
+        }
+        // Whole blocks were copied; past len the file must read as zeros if
+        // a later write extends it
+        int tail = len % UFS_BLOCK_SIZE;
+        if (rc == 0 && tail != 0) {
+            off_t at = (off_t) fresh[nblocks - 1] * UFS_BLOCK_SIZE + tail;
+            rc = (disk_pwrite(zeros, UFS_BLOCK_SIZE - tail, at) == UFS_BLOCK_SIZE - tail) ? 0 : -1;
+        }
+    } else if (nblocks > 0) {
+        char *buffer = calloc(nblocks, UFS_BLOCK_SIZE);
+        if (buffer == NULL || fs_read(src_inum, buffer, offset, len) != len) {
+            rc = -1;
+        }
+        for (int k = 0; k < nblocks && rc == 0; ) {
+            int run = 1;
+            while (k + run < nblocks && fresh[k + run] == fresh[k] + run) {
+                run++;
+            }
+            size_t bytes = (size_t) run * UFS_BLOCK_SIZE;
+            unsigned long t = trace_begin();
+            rc = (disk_pwrite(buffer + (size_t) k * UFS_BLOCK_SIZE, bytes, (off_t) fresh[k] * UFS_BLOCK_SIZE) == (ssize_t) bytes) ? 0 : -1;
+            trace_end(PH_BLOCK_IO, t);
+            k += run;
+        }
+        free(buffer);
+    }
+    if (rc != 0) {
+        release_blocks(fresh, nblocks);
+        return -1;
+    }
 
-        if (write_block(new_block, entries) != UFS_BLOCK_SIZE) {
-            set_bitmap(superblock.inode_bitmap_addr, superblock.inode_bitmap_len, new_inum, 0);
-            free_data_block(new_block);
-            return -6;
+    memcpy(dst.direct, fresh, sizeof(fresh));
+    dst.size = len;
+    if (put_inode(dst_inum, &dst) != 0) {
+        release_blocks(fresh, nblocks);
+        return -1;
+    }
+    return release_blocks(old, DIRECT_PTRS);
+}
+
+// ---------------------------------------------------------------------------
+// Leases
+//
+// A server can grant a client (a "holder", any small integer it uses to name
+// one) a read lease on an inode. While the lease lasts the client may answer
+// MFS_Stat, MFS_Read and, for a directory, MFS_Lookup from its own cache.
+// Before anything that changes a leased inode (writing a file; creating,
+// unlinking or replacing an entry in a directory; removing the inode) is
+// applied, the engine takes the leases back and calls the volume's recall
+// callback once per holder, so no one can read the new state while a holder
+// still answers from the old. The change drops the volume's lock meanwhile:
+// each callback runs on its own thread, may block on its client or call back
+// into the engine, and the change waits until every one has returned or its
+// lease has run out. It then takes the lock again and looks once more, since
+// leases may have been granted in between, and applies itself only once a
+// look under the lock finds nothing to recall. Expired leases are dropped
+// without a recall.
+// ---------------------------------------------------------------------------
+
+static void free_leases(void) {
+    if (vol->leases == NULL) {
+        return;
+    }
+    for (int i = 0; i < vol->superblock.num_inodes; i++) {
+        while (vol->leases[i] != NULL) {
+            lease_t *next = vol->leases[i]->next;
+            free(vol->leases[i]);
+            vol->leases[i] = next;
         }
     }
+    free(vol->leases);
+    vol->leases = NULL;
+}
 
-    // Write new inode
-    if (put_inode(new_inum, &new_inode) != 0) {
-        set_bitmap(superblock.inode_bitmap_addr, superblock.inode_bitmap_len, new_inum, 0);
-        if (type == UFS_DIRECTORY) {
-            free_data_block(new_inode.direct[0]);
+static __thread lease_t *recalled;     // taken back by the current op
+static __thread MFS_Recall_t recall_fn;
+static __thread void *recall_fn_arg;
+
+static void lease_recall(int inum) {
+    if (vol->leases == NULL || inum < 0 || inum >= vol->superblock.num_inodes) {
+        return;
+    }
+    unsigned long now = now_ns();
+    lease_t *l = vol->leases[inum];
+    vol->leases[inum] = NULL;
+    while (l != NULL) {
+        lease_t *next = l->next;
+        if (l->expires > now && vol->recall != NULL) {
+            recall_fn = vol->recall;
+            recall_fn_arg = vol->recall_arg;
+            l->next = recalled;
+            recalled = l;
+        } else {
+            free(l);
         }
-        return -7;
+        l = next;
+    }
+}
+
+// The recalls of one round. A holder still busy when its lease runs out is
+// left to finish alone, so whichever of the change and the deliveries lets
+// go last frees the round.
+typedef struct recall_job {
+    struct recall_round *round;
+    int holder;
+    int inum;
+    unsigned long expires;
+    int done;
+} recall_job_t;
+
+typedef struct recall_round {
+    pthread_mutex_t lock;
+    pthread_cond_t returned;
+    int refs;                   // the waiting change plus running deliveries
+    volume_t *v;
+    MFS_Recall_t fn;
+    void *arg;
+    int count;
+    recall_job_t jobs[];
+} recall_round_t;
+
+// Drops a reference; called with the round's lock held
+static void recall_round_put(recall_round_t *r) {
+    int last = (--r->refs == 0);
+    pthread_mutex_unlock(&r->lock);
+    if (last) {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->returned);
+        free(r);
     }
+}
 
-    // Add entry to parent directory
-    for (int i = 0; i < DIRECT_PTRS; i++) {
-        if (parent_inode.direct[i] == -1) {
+static void recall_job_done(recall_job_t *job) {
+    recall_round_t *r = job->round;
+    pthread_mutex_lock(&r->lock);
+    job->done = 1;
+    pthread_cond_broadcast(&r->returned);
+    recall_round_put(r);
+}
+
+// A delivery thread has the volume selected for it, so the callback may call
+// in and the volume cannot be unmounted under it
+static void *deliver_recall(void *arg) {
+    recall_job_t *job = arg;
+    vol = job->round->v;
+    pthread_setspecific(vol_key, vol);
+    job->round->fn(job->holder, job->inum, job->round->arg);
+    recall_job_done(job);
+    return NULL;
+}
+
+// Tells the holders of the leases taken back so far and waits, without the
+// volume's lock, until each callback has returned or its lease has run out
+static void deliver_recalls(void) {
+    int count = 0;
+    for (lease_t *l = recalled; l != NULL; l = l->next) {
+        count++;
+    }
+    recall_round_t *r = malloc(sizeof(recall_round_t) + count * sizeof(recall_job_t));
+    if (r == NULL) {
+        // No room to track them: deliver one by one and wait for each
+        unlock_volume();
+        while (recalled != NULL) {
+            lease_t *l = recalled;
+            recalled = l->next;
+            recall_fn(l->holder, l->inum, recall_fn_arg);
+            STAT_ADD(leases_recalled, 1);
+            free(l);
+        }
+        lock_exclusive();
+        return;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&r->returned, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&r->lock, NULL);
+    r->refs = 1 + count;
+    r->v = vol;
+    r->fn = recall_fn;
+    r->arg = recall_fn_arg;
+    r->count = count;
+    for (int i = 0; i < count; i++) {
+        lease_t *l = recalled;
+        recalled = l->next;
+        r->jobs[i] = (recall_job_t) { r, l->holder, l->inum, l->expires, 0 };
+        free(l);
+    }
+    STAT_ADD(leases_recalled, count);
+    unlock_volume();
+
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < count; i++) {
+        pthread_t tid;
+        pthread_mutex_lock(&volumes_lock);
+        vol->users++;
+        pthread_mutex_unlock(&volumes_lock);
+        if (pthread_create(&tid, &detached, deliver_recall, &r->jobs[i]) != 0) {
+            pthread_mutex_lock(&volumes_lock);
+            vol->users--;
+            pthread_mutex_unlock(&volumes_lock);
+            r->fn(r->jobs[i].holder, r->jobs[i].inum, r->arg);
+            recall_job_done(&r->jobs[i]);
+        }
+    }
+    pthread_attr_destroy(&detached);
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        unsigned long now = now_ns();
+        unsigned long wake = 0;
+        for (int i = 0; i < count; i++) {
+            recall_job_t *job = &r->jobs[i];
+            if (!job->done && job->expires > now && (wake == 0 || job->expires < wake)) {
+                wake = job->expires;
+            }
+        }
+        if (wake == 0) {
+            break;
+        }
+        struct timespec ts = { wake / 1000000000UL, wake % 1000000000UL };
+        pthread_cond_timedwait(&r->returned, &r->lock, &ts);
+    }
+    recall_round_put(r);
+    lock_exclusive();
+}
+
+// Recalls leases on root and on every leased inode below it
+static void lease_recall_tree(int root) {
+    if (vol->leases == NULL) {
+        return;
+    }
+    for (int inum = 0; inum < vol->superblock.num_inodes; inum++) {
+        if (vol->leases[inum] == NULL) {
             continue;
         }
-        dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
-        if (read_block(parent_inode.direct[i], entries) != UFS_BLOCK_SIZE) {
+        int up = inum;
+        int depth = 0;
+        while (up != root && up > 0 && depth++ < vol->superblock.num_inodes) {
+            up = vol->parent_of[up];
+        }
+        if (up == root) {
+            lease_recall(inum);
+        }
+    }
+}
+
+// Recalls leases on a directory and on the entry name inside it, if any
+static void lease_recall_entry(int pinum, char *name) {
+    lease_recall(pinum);
+    if (name != NULL && vol->leases != NULL) {
+        lease_recall(index_find(pinum, name));
+    }
+}
+
+// Whether anyone holds a live lease on inum
+static int lease_held(int inum) {
+    if (vol->leases == NULL) {
+        return 0;
+    }
+    unsigned long now = now_ns();
+    for (lease_t *l = vol->leases[inum]; l != NULL; l = l->next) {
+        if (l->expires > now) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int MFS_SetRecall(MFS_Recall_t fn, void *arg) {
+    if (vol == NULL) {
+        return -1;
+    }
+    lock_exclusive();
+    vol->recall = fn;
+    vol->recall_arg = arg;
+    unlock_volume();
+    return 0;
+}
+
+static int lease_grant(int holder, int inum, int seconds) {
+    inode_t inode;
+    if (seconds <= 0 || get_inode(inum, &inode) != 0 || !bit_test(&vol->inode_map, inum)) {
+        return -1;
+    }
+    if (vol->leases == NULL) {
+        vol->leases = calloc(vol->superblock.num_inodes, sizeof(lease_t *));
+        if (vol->leases == NULL) {
             return -1;
         }
-        for (int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
-            if (entries[j].inum == -1) {
-                strcpy(entries[j].name, name);
-                entries[j].inum = new_inum;
-                if (write_block(parent_inode.direct[i], entries) != UFS_BLOCK_SIZE) {
-                    return -1;
-                }
-                parent_inode.size += sizeof(dir_ent_t);
-                return put_inode(pinum, &parent_inode) == 0 ? 0 : -1;
-            }
+    }
+    unsigned long expires = now_ns() + (unsigned long) seconds * 1000000000UL;
+    for (lease_t *l = vol->leases[inum]; l != NULL; l = l->next) {
+        if (l->holder == holder) {
+            l->expires = expires;   // Renewal
+            return 0;
         }
     }
+    lease_t *l = malloc(sizeof(lease_t));
+    if (l == NULL) {
+        return -1;
+    }
+    l->holder = holder;
+    l->inum = inum;
+    l->expires = expires;
+    l->next = vol->leases[inum];
+    vol->leases[inum] = l;
+    STAT_ADD(leases_granted, 1);
+    return 0;
+}
 
-    // If we get here, the parent directory is full
+static int lease_release(int holder, int inum) {
+    if (vol == NULL || vol->leases == NULL || inum < 0 || inum >= vol->superblock.num_inodes) {
+        return -1;
+    }
+    for (lease_t **p = &vol->leases[inum]; *p != NULL; p = &(*p)->next) {
+        if ((*p)->holder == holder) {
+            lease_t *l = *p;
+            *p = l->next;
+            free(l);
+            return 0;
+        }
+    }
     return -1;
 }
 
-// Add this function to free an inode
-int free_inode(int inum) {
-    return set_bitmap(superblock.inode_bitmap_addr, superblock.inode_bitmap_len, inum, 0);
+int MFS_Lease(int holder, int inum, int seconds) {
+    lock_exclusive();
+    int rc = lease_grant(holder, inum, seconds);
+    unlock_volume();
+    return rc;
 }
 
-// Recursive function to remove all contents of a directory
-int remove_directory_contents(int inum) {
-    inode_t inode;
-    if (get_inode(inum, &inode) != 0) {
-        return -9;
+int MFS_Release(int holder, int inum) {
+    lock_exclusive();
+    int rc = lease_release(holder, inum);
+    unlock_volume();
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Replication
+//
+// A primary streams every committed op to its backups as a block delta: the
+// byte ranges the op wrote (taken from the dirty list commit() already
+// keeps) with their new contents, plus the name-index changes the op made,
+// so a backup can keep its in-memory indexes current without rescanning
+// directories. Deltas carry a sequence number; a backup applies them in
+// order to its own image, and serves reads while read-only. Promotion makes
+// it writable. Moving deltas between hosts is up to the caller.
+//
+// Numbers live only in memory, so they are scoped to a stream: each
+// MFS_SetReplicator on a mounted volume starts a new one, with a fresh id,
+// at seq 1. A backup starts as a copy taken before the stream began, takes
+// the id of the first delta it applies, which must be seq 1, and refuses
+// anything from another stream or past a gap. A primary that remounts, or
+// drops its replicator and sets it again (changes in between were never
+// sent), thus cannot have its deltas taken as resends; its backups fail
+// until they are reseeded.
+//
+// Delta layout (native endianness, as the image itself):
+//   delta_hdr_t, then nranges x (delta_range_t + len bytes),
+//   then nevents x delta_event_t
+// ---------------------------------------------------------------------------
+
+#define DELTA_MAGIC (0x4d465344u)  // "MFSD"
+
+typedef struct {
+    unsigned int magic;
+    unsigned int nranges;
+    unsigned int nevents;
+    unsigned int pad;
+    unsigned long stream;
+    unsigned long seq;
+    unsigned long committed_ns;    // CLOCK_REALTIME, for lag on the backup
+} delta_hdr_t;
+
+typedef struct {
+    long offset;
+    long len;
+} delta_range_t;
+
+typedef struct {
+    int kind;                      // '+' add name -> inum, '-' remove name
+    int pinum;
+    int inum;
+    char name[28];
+} delta_event_t;
+
+static __thread delta_event_t *events;
+static __thread int event_count;
+static __thread int event_cap;
+static __thread int events_lost;   // an event of this op did not fit
+
+static unsigned long wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Name-index changes are only recorded while someone is listening
+static void repl_event(char kind, int pinum, const char *name, int inum) {
+    if (vol == NULL || vol->replicate == NULL) {
+        return;
+    }
+    if (event_count == event_cap) {
+        int cap = event_cap ? event_cap * 2 : 16;
+        delta_event_t *grown = realloc(events, cap * sizeof(delta_event_t));
+        if (grown == NULL) {
+            events_lost = 1;
+            return;
+        }
+        pthread_setspecific(events_key, grown);
+        events = grown;
+        event_cap = cap;
     }
+    delta_event_t *e = &events[event_count++];
+    memset(e, 0, sizeof(*e));
+    e->kind = kind;
+    e->pinum = pinum;
+    e->inum = inum;
+    strncpy(e->name, name, sizeof(e->name) - 1);
+}
 
-    for (int i = 0; i < DIRECT_PTRS && inode.direct[i] != -1; i++) {
-        dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
-        if (read_block(inode.direct[i], entries) != UFS_BLOCK_SIZE) {
-            return -8;
+// The op changed the primary but its delta cannot be sent. Its number is
+// used up all the same, so the backups see a gap at the next delta and fail
+// until reseeded, rather than silently falling behind.
+static void delta_lost(void) {
+    __atomic_add_fetch(&vol->seq, 1, __ATOMIC_RELAXED);
+    STAT_ADD(deltas_lost, 1);
+    event_count = 0;
+    events_lost = 0;
+}
+
+// Called by commit(): encodes the op's delta and hands it to the replicator
+static void replicate(int durable) {
+    if (vol->replicate == NULL) {
+        event_count = 0;
+        events_lost = 0;
+        return;
+    }
+    if (!durable || events_lost) {
+        delta_lost();
+        return;
+    }
+    size_t len = sizeof(delta_hdr_t) + event_count * sizeof(delta_event_t);
+    for (int i = 0; i < dirty_count; i++) {
+        len += sizeof(delta_range_t) + (dirty[i].end - dirty[i].start);
+    }
+    char *delta = malloc(len);
+    if (delta == NULL) {
+        delta_lost();
+        return;
+    }
+
+    delta_hdr_t *h = (delta_hdr_t *) delta;
+    memset(h, 0, sizeof(*h));
+    h->magic = DELTA_MAGIC;
+    h->nranges = dirty_count;
+    h->nevents = event_count;
+    h->stream = vol->stream;
+    h->committed_ns = wall_ns();
+    char *p = delta + sizeof(delta_hdr_t);
+    for (int i = 0; i < dirty_count; i++) {
+        delta_range_t r = { dirty[i].start, dirty[i].end - dirty[i].start };
+        memcpy(p, &r, sizeof(r));
+        p += sizeof(r);
+        if (vol->map != NULL && dirty[i].end <= (off_t) vol->map_len) {
+            memcpy(p, vol->map + dirty[i].start, r.len);
+        } else if (disk_pread(p, r.len, r.offset) != r.len) {
+            free(delta);
+            delta_lost();
+            return;
         }
+        p += r.len;
+    }
+    memcpy(p, events, event_count * sizeof(delta_event_t));
+    event_count = 0;
+    h->seq = __atomic_add_fetch(&vol->seq, 1, __ATOMIC_RELAXED);
 
-        for (int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
-            if (entries[j].inum != -1 && 
-                strcmp(entries[j].name, ".") != 0 && 
-                strcmp(entries[j].name, "..") != 0) {
-                
-                inode_t child_inode;
-                if (get_inode(entries[j].inum, &child_inode) != 0) {
-                    return -7;
-                }
+    STAT_ADD(deltas_sent, 1);
+    STAT_ADD(delta_bytes, len);
+    vol->replicate(delta, (int) len, vol->replicate_arg);
+    free(delta);
+}
 
-                if (child_inode.type == UFS_DIRECTORY) {
-                    if (remove_directory_contents(entries[j].inum) != 0) {
-                        return -1;
-                    }
-                }
+// Recounts the summary of every group in [first, last] of a bitmap after
+// its words were overwritten by a delta
+static void resummarize(bitmap_t *map, int first_group, int last_group) {
+    for (int g = first_group; g <= last_group; g++) {
+        int bits = map->num_bits - g * GROUP_BITS;
+        if (bits <= 0) {
+            break;
+        }
+        if (bits > GROUP_BITS) {
+            bits = GROUP_BITS;
+        }
+        unsigned int *words = map->words + g * GROUP_WORDS;
+        int used = 0;
+        for (int w = 0; w < bits / 32; w++) {
+            used += __builtin_popcount(words[w]);
+        }
+        if (bits % 32 != 0) {
+            used += __builtin_popcount(words[bits / 32] >> (32 - bits % 32));
+        }
+        int delta = (bits - used) - map->group_free[g];
+        map->group_free[g] += delta;
+        map->block_free[g / GROUPS_PER_BLOCK] += delta;
+        __atomic_store_n(map->gauge, *map->gauge + delta, __ATOMIC_RELAXED);
+    }
+}
 
-                // Free all data blocks
-                for (int k = 0; k < DIRECT_PTRS && child_inode.direct[k] != -1; k++) {
-                    if (free_data_block(child_inode.direct[k]) != 0) {
-                        return -1;
-                    }
-                }
+// Keeps the in-memory copy of [offset, offset + len) current if the range
+// falls in the metadata region
+static void apply_to_metadata(long offset, long len, const char *bytes) {
+    long meta_start = UFS_BLOCK_SIZE;
+    long meta_end = (long) vol->superblock.data_region_addr * UFS_BLOCK_SIZE;
+    long from = (offset > meta_start) ? offset : meta_start;
+    long to = (offset + len < meta_end) ? offset + len : meta_end;
+    if (from >= to) {
+        return;
+    }
+    memcpy(vol->metadata + (from - meta_start), bytes + (from - offset), to - from);
 
-                // Free the inode
-                if (free_inode(entries[j].inum) != 0) {
-                    return -1;
-                }
+    bitmap_t *maps[2] = { &vol->inode_map, &vol->data_map };
+    for (int m = 0; m < 2; m++) {
+        long map_start = (long) maps[m]->addr * UFS_BLOCK_SIZE;
+        long map_end = map_start + (long) maps[m]->len * UFS_BLOCK_SIZE;
+        long a = (from > map_start) ? from : map_start;
+        long b = (to < map_end) ? to : map_end;
+        if (a < b) {
+            resummarize(maps[m], (a - map_start) * 8 / GROUP_BITS, (b - 1 - map_start) * 8 / GROUP_BITS);
+        }
+    }
+}
+
+// Checks everything about a delta before anything is applied: 0 if it is
+// the next one for this backup, 1 if the backup already has it, -1 if it is
+// malformed or from elsewhere
+static int delta_check(const char *delta, int len, delta_hdr_t *h) {
+    if (len < (int) sizeof(*h)) {
+        return -1;
+    }
+    memcpy(h, delta, sizeof(*h));
+    if (h->magic != DELTA_MAGIC) {
+        return -1;
+    }
+    if (h->stream == 0 || (vol->stream != 0 && h->stream != vol->stream)) {
+        return -1;          // Another stream: the backup needs reseeding
+    }
+    if (h->seq <= vol->seq) {
+        return 1;           // Already have it; resends are harmless
+    }
+    if (h->seq != vol->seq + 1) {
+        return -1;          // Gap, or a fresh copy joining midway
+    }
+
+    long image_len = ((long) vol->superblock.data_region_addr + vol->superblock.data_region_len) * UFS_BLOCK_SIZE;
+    const char *p = delta + sizeof(*h);
+    const char *end = delta + len;
+    for (unsigned int i = 0; i < h->nranges; i++) {
+        delta_range_t r;
+        if (end - p < (long) sizeof(r)) {
+            return -1;
+        }
+        memcpy(&r, p, sizeof(r));
+        if (r.offset < UFS_BLOCK_SIZE || r.offset > image_len || r.len < 0 || r.len > image_len - r.offset ||
+            end - p - (long) sizeof(r) < r.len) {
+            return -1;
+        }
+        p += sizeof(r) + r.len;
+    }
+    if (end - p != (long) (h->nevents * sizeof(delta_event_t))) {
+        return -1;
+    }
+    return 0;
+}
+
+// Takes back the leases on what a checked delta changes: inodes whose table
+// entries it writes and directories it adds names to or removes them from
+static void delta_recall(const char *delta, const delta_hdr_t *h) {
+    long inodes_start = (long) vol->superblock.inode_region_addr * UFS_BLOCK_SIZE;
+    long inodes_end = inodes_start + (long) vol->superblock.num_inodes * sizeof(inode_t);
+    const char *p = delta + sizeof(*h);
+    for (unsigned int i = 0; i < h->nranges; i++) {
+        delta_range_t r;
+        memcpy(&r, p, sizeof(r));
+        p += sizeof(r) + r.len;
+        long from = (r.offset > inodes_start) ? r.offset : inodes_start;
+        long to = (r.offset + r.len < inodes_end) ? r.offset + r.len : inodes_end;
+        for (long i = (from - inodes_start) / (long) sizeof(inode_t);
+             from < to && inodes_start + i * (long) sizeof(inode_t) < to; i++) {
+            lease_recall(i);
+        }
+    }
+    for (unsigned int i = 0; i < h->nevents; i++) {
+        delta_event_t e;
+        memcpy(&e, p + i * sizeof(e), sizeof(e));
+        lease_recall(e.pinum);
+    }
+}
+
+static long apply_delta(const char *delta, int len) {
+    delta_hdr_t h;
+    int checked = delta_check(delta, len, &h);
+    if (checked != 0) {
+        return (checked > 0) ? (long) vol->seq : -1;
+    }
+
+    const char *p = delta + sizeof(h);
+    for (unsigned int i = 0; i < h.nranges; i++) {
+        delta_range_t r;
+        memcpy(&r, p, sizeof(r));
+        p += sizeof(r);
+        if (disk_pwrite(p, r.len, r.offset) != r.len) {
+            return -1;
+        }
+        apply_to_metadata(r.offset, r.len, p);
+        p += r.len;
+    }
+    for (unsigned int i = 0; i < h.nevents; i++) {
+        delta_event_t e;
+        memcpy(&e, p + i * sizeof(e), sizeof(e));
+        e.name[sizeof(e.name) - 1] = '\0';
+        if (e.pinum < 0 || e.pinum >= vol->superblock.num_inodes) {
+            continue;
+        }
+        int named = strcmp(e.name, ".") != 0 && strcmp(e.name, "..") != 0;
+        if (e.kind == '+' && e.inum >= 0 && e.inum < vol->superblock.num_inodes) {
+            index_insert(e.pinum, e.name, e.inum);
+            if (named) {
+                vol->parent_of[e.inum] = e.pinum;
+            } else if (strcmp(e.name, ".") == 0) {
+                vol->child_block[e.inum] = -1;
             }
+        } else if (e.kind == '-') {
+            int victim = index_find(e.pinum, e.name);
+            index_remove(e.pinum, e.name);
+            if (named && victim >= 0) {
+                vol->parent_of[victim] = -1;
+            }
+        }
+    }
+
+    // Forwarded deltas (a backup feeding its own backups) keep their number
+    vol->stream = h.stream;
+    vol->seq = h.seq - 1;
+    int rc = commit();
+    vol->seq = h.seq;
+    vol->committed_ns = h.committed_ns;
+    vol->applied_ns = wall_ns();
+    STAT_ADD(deltas_applied, 1);
+    return (rc == 0) ? (long) h.seq : -1;
+}
+
+int MFS_SetReplicator(MFS_Replicate_t fn, void *arg) {
+    if (vol == NULL) {
+        return -1;
+    }
+    lock_exclusive();
+    vol->replicate = fn;
+    vol->replicate_arg = arg;
+    if (fn != NULL) {
+        // Unique across remounts and volumes; never 0
+        vol->stream = (wall_ns() ^ ((unsigned long) getpid() << 40) ^ ((unsigned long) vol->id << 56)) | 1;
+        __atomic_store_n(&vol->seq, 0, __ATOMIC_RELAXED);
+    }
+    unlock_volume();
+    return 0;
+}
+
+int MFS_Replica(int on) {
+    if (vol == NULL) {
+        return -1;
+    }
+    lock_exclusive();
+    if (!on && vol->read_only) {
+        // Promotion: slot caches may predate deltas applied since
+        for (int i = 0; i < vol->superblock.num_inodes; i++) {
+            dir_slots_drop(i);
+        }
+    }
+    vol->read_only = on;
+    unlock_volume();
+    return 0;
+}
+
+long MFS_ApplyDelta(char *delta, int len) {
+    if (vol == NULL || delta == NULL) {
+        return -1;
+    }
+    unsigned long start = op_begin(OP_APPLY);
+    lock_exclusive();
+    delta_hdr_t h;
+    while (vol->read_only && delta_check(delta, len, &h) == 0) {
+        delta_recall(delta, &h);
+        if (recalled == NULL) {
+            break;
+        }
+        deliver_recalls();
+    }
+    long rc = vol->read_only ? apply_delta(delta, len) : -1;
+    unlock_volume();
+    op_end(OP_APPLY, start, rc < 0);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Defragmentation
+//
+// A file written a block at a time next to other growing files, or grown
+// long after it was created, ends up with its blocks scattered, and reading
+// it sequentially seeks between them. fs_defrag walks the inode table from
+// where the previous call stopped and moves every file or directory whose
+// blocks are not one ascending run into a free run of the same length near
+// its parent, until it has moved budget blocks. Each batch is committed in
+// three steps: the new runs are allocated and filled, then the inodes are
+// switched over, then the old blocks are freed. A crash between steps leaves
+// the old layout or the new one intact, with at worst a leaked run for fsck
+// to reclaim. Leased inodes are left where they are, since a holder may have
+// mapped their blocks; a later call moves them once the leases are gone.
+// ---------------------------------------------------------------------------
+
+#define DEFRAG_BATCH (64)   // inodes moved per call at most
+
+typedef struct {
+    int inum;
+    int count;
+    int first;              // new run
+    int old[DIRECT_PTRS];   // relative to the data region
+} defrag_move_t;
+
+// Number of runs of consecutive blocks holding an inode's data; sets *count
+// to the number of blocks
+static int extents_of(inode_t *inode, int *count) {
+    int extents = 0, n = 0;
+    unsigned int prev = 0;
+    for (int k = 0; k < DIRECT_PTRS; k++) {
+        if (inode->direct[k] == -1) {
+            continue;
+        }
+        if (n == 0 || inode->direct[k] != prev + 1) {
+            extents++;
         }
+        prev = inode->direct[k];
+        n++;
     }
-
-    return 0;
+    *count = n;
+    return extents;
 }
 
-int MFS_Unlink(int pinum, char *name) {
-    if (pinum < 0 || name == NULL || strlen(name) > 27) {
-        return -2;
+// Allocates a run for inum and copies its blocks there, in order. Returns
+// 1 if inum is left where it is, and -1 if the copy failed (m then holds
+// the run to give back).
+static int defrag_stage(int inum, defrag_move_t *m) {
+    inode_t inode;
+    int count;
+    if (get_inode(inum, &inode) != 0 || extents_of(&inode, &count) <= 1) {
+        return 1;
     }
-
-    inode_t parent_inode;
-    if (get_inode(pinum, &parent_inode) != 0 || parent_inode.type != UFS_DIRECTORY) {
-        return -3;
+    int first = allocate_data_run(count, data_goal_for(inum));
+    if (first == -1) {
+        return 1;   // no free run that long
     }
+    m->inum = inum;
+    m->count = 0;
+    m->first = first;
+    for (int k = 0; k < DIRECT_PTRS; k++) {
+        if (inode.direct[k] != -1) {
+            m->old[m->count++] = inode.direct[k] - vol->superblock.data_region_addr;
+        }
+    }
+    int rc = 0;
+    for (int i = 0; i < count && rc == 0; ) {
+        int run = 1;
+        while (i + run < count && m->old[i + run] == m->old[i] + run) {
+            run++;
+        }
+        unsigned long t = trace_begin();
+        rc = disk_copy((off_t) (vol->superblock.data_region_addr + m->old[i]) * UFS_BLOCK_SIZE,
+                       (off_t) (first + i) * UFS_BLOCK_SIZE, (size_t) run * UFS_BLOCK_SIZE);
+        trace_end(PH_BLOCK_IO, t);
+        i += run;
+    }
+    return rc;
+}
 
-    int target_inum = -1;
-    int target_block = -1;
-    int target_entry = -1;
-
-    // Find the entry to be removed
-    for (int i = 0; i < DIRECT_PTRS && parent_inode.direct[i] != -1; i++) {
-        dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
-        if (read_block(parent_inode.direct[i], entries) != UFS_BLOCK_SIZE) {
-            return -4;
+static long fs_defrag(long budget) {
+    defrag_move_t *moves = malloc(DEFRAG_BATCH * sizeof(defrag_move_t));
+    if (moves == NULL) {
+        return -1;
+    }
+    int num_inodes = vol->superblock.num_inodes;
+    int nmoves = 0;
+    long moved = 0;
+    int rc = 0;
+    for (int scanned = 0; scanned < num_inodes && nmoves < DEFRAG_BATCH && moved < budget; scanned++) {
+        int inum = vol->defrag_next;
+        int count;
+        if (!bit_test(&vol->inode_map, inum) || extents_of(&vol->inode_table[inum], &count) <= 1 ||
+            lease_held(inum)) {
+            vol->defrag_next = (inum + 1) % num_inodes;
+            continue;
+        }
+        if (moved > 0 && moved + count > budget) {
+            break;  // resume with this one next time
         }
+        vol->defrag_next = (inum + 1) % num_inodes;
+        int staged = defrag_stage(inum, &moves[nmoves]);
+        if (staged < 0) {
+            nmoves++;   // its run is given back with the others below
+            rc = -1;
+            break;
+        }
+        if (staged == 0) {
+            moved += moves[nmoves++].count;
+        }
+    }
 
-        for (int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
-            if (entries[j].inum != -1 && strcmp(entries[j].name, name) == 0) {
-                target_inum = entries[j].inum;
-                target_block = i;
-                target_entry = j;
-                break;
+    if (rc == 0) {
+        rc = commit();
+    }
+    if (rc != 0) {
+        for (int i = 0; i < nmoves; i++) {
+            int indexes[DIRECT_PTRS];
+            for (int k = 0; k < moves[i].count; k++) {
+                indexes[k] = moves[i].first - vol->superblock.data_region_addr + k;
             }
+            set_bits_bulk(&vol->data_map, indexes, moves[i].count, 0);
         }
-
-        if (target_inum != -1) break;
+        commit();
+        free(moves);
+        return -1;
     }
 
-    if (target_inum == -1) {
-        return 0;  // File or directory not found, which is considered success
+    for (int i = 0; i < nmoves && rc == 0; i++) {
+        inode_t inode;
+        rc = get_inode(moves[i].inum, &inode);
+        for (int k = 0, b = 0; k < DIRECT_PTRS && rc == 0; k++) {
+            if (inode.direct[k] != -1) {
+                inode.direct[k] = moves[i].first + b++;
+            }
+        }
+        if (rc == 0) {
+            rc = put_inode(moves[i].inum, &inode);
+        }
+    }
+    if (commit() != 0 || rc != 0) {
+        free(moves);
+        return -1;
     }
 
-    inode_t target_inode;
-    if (get_inode(target_inum, &target_inode) != 0) {
-        return -5;
+    for (int i = 0; i < nmoves && rc == 0; i++) {
+        rc = set_bits_bulk(&vol->data_map, moves[i].old, moves[i].count, 0);
+        STAT_ADD(block_frees, moves[i].count);
+        STAT_ADD(defrag_files, 1);
+        STAT_ADD(defrag_blocks, moves[i].count);
+    }
+    if (commit() != 0 || rc != 0) {
+        moved = -1;
     }
+    free(moves);
+    return moved;
+}
 
-    // If it's a directory, make sure it's empty (except for . and ..)
-    if (target_inode.type == UFS_DIRECTORY) {
-        if (target_inode.size > 2 * sizeof(dir_ent_t)) {
-            return -1;  // Directory not empty
-        }
-        
-        // Remove contents (this is just a safety measure, as the directory should be empty)
-        if (remove_directory_contents(target_inum) != 0) {
-            return -1;
+// Mutations are refused on a backup until it is promoted
+static int writable(void) {
+    return vol != NULL && !vol->read_only;
+}
+
+// Public entry points: each one is timed and counted, and every call that can
+// change the image commits before returning. Mutations first take back
+// conflicting leases and wait for their holders (see "Leases"), then apply
+// themselves in the same hold of the volume's lock as the last look.
+
+int MFS_Lookup(int pinum, char *name) {
+    unsigned long start = op_begin(OP_LOOKUP);
+    lock_shared();
+    int rc = fs_lookup(pinum, name);
+    unlock_volume();
+    op_end(OP_LOOKUP, start, rc < 0);
+    return rc;
+}
+
+int MFS_Stat(int inum, MFS_Stat_t *m) {
+    unsigned long start = op_begin(OP_STAT);
+    lock_shared();
+    int rc = fs_stat(inum, m);
+    unlock_volume();
+    op_end(OP_STAT, start, rc < 0);
+    return rc;
+}
+
+int MFS_Read(int inum, char *buffer, int offset, int nbytes) {
+    unsigned long start = op_begin(OP_READ);
+    lock_shared();
+    int rc = fs_read(inum, buffer, offset, nbytes);
+    unlock_volume();
+    op_end(OP_READ, start, rc < 0);
+    return rc;
+}
+
+int MFS_ReadMap(int inum, int offset, int nbytes, struct iovec *iov, int iovcnt) {
+    unsigned long start = op_begin(OP_READ);
+    lock_shared();
+    int rc = fs_read_map(inum, offset, nbytes, iov, iovcnt);
+    unlock_volume();
+    op_end(OP_READ, start, rc < 0);
+    return rc;
+}
+
+int MFS_Write(int inum, char *buffer, int offset, int nbytes) {
+    unsigned long start = op_begin(OP_WRITE);
+    lock_exclusive();
+    while (writable()) {
+        lease_recall(inum);
+        if (recalled == NULL) {
+            break;
         }
+        deliver_recalls();
+    }
+    int rc = writable() ? fs_write(inum, buffer, offset, nbytes) : -1;
+    if (unlock_commit() != 0) {
+        rc = -1;
     }
+    op_end(OP_WRITE, start, rc < 0);
+    return rc;
+}
 
-    // Free all data blocks
-    for (int i = 0; i < DIRECT_PTRS && target_inode.direct[i] != -1; i++) {
-        if (free_data_block(target_inode.direct[i]) != 0) {
-            return -1;
+int MFS_Creat(int pinum, int type, char *name) {
+    unsigned long start = op_begin(OP_CREAT);
+    lock_exclusive();
+    while (writable() && name != NULL && index_find(pinum, name) < 0) {
+        lease_recall(pinum);
+        if (recalled == NULL) {
+            break;
         }
+        deliver_recalls();
     }
+    int rc = writable() ? fs_creat(pinum, type, name) : -1;
+    if (unlock_commit() != 0) {
+        rc = -1;
+    }
+    op_end(OP_CREAT, start, rc < 0);
+    return rc;
+}
 
-    // Free the inode
-    if (free_inode(target_inum) != 0) {
-        return -1;
+int MFS_Unlink(int pinum, char *name) {
+    unsigned long start = op_begin(OP_UNLINK);
+    lock_exclusive();
+    while (writable()) {
+        lease_recall_entry(pinum, name);
+        if (recalled == NULL) {
+            break;
+        }
+        deliver_recalls();
+    }
+    int rc = writable() ? fs_unlink(pinum, name) : -1;
+    if (unlock_commit() != 0) {
+        rc = -1;
     }
+    op_end(OP_UNLINK, start, rc < 0);
+    return rc;
+}
 
-    // Remove the entry from the parent directory
-    dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
-    if (read_block(parent_inode.direct[target_block], entries) != UFS_BLOCK_SIZE) {
-        return -1;
+int MFS_RemoveTree(int pinum, char *name) {
+    unsigned long start = op_begin(OP_REMOVETREE);
+    lock_exclusive();
+    while (writable() && name != NULL) {
+        int victim = index_find(pinum, name);
+        lease_recall(pinum);
+        if (victim > 0) {
+            lease_recall_tree(victim);
+        }
+        if (recalled == NULL) {
+            break;
+        }
+        deliver_recalls();
+    }
+    int rc = writable() ? fs_remove_tree(pinum, name) : -1;
+    if (unlock_commit() != 0) {
+        rc = -1;
     }
+    op_end(OP_REMOVETREE, start, rc < 0);
+    return rc;
+}
 
-    entries[target_entry].inum = -1;  // Mark the entry as unused
-    memset(entries[target_entry].name, 0, 28);  // Clear the name
+int MFS_Copy(int src_inum, int dst_pinum, char *name) {
+    return MFS_CopyRange(src_inum, dst_pinum, name, 0, -1);
+}
 
-    if (write_block(parent_inode.direct[target_block], entries) != UFS_BLOCK_SIZE) {
-        return -1;
+int MFS_CopyRange(int src_inum, int dst_pinum, char *name, int offset, int nbytes) {
+    unsigned long start = op_begin(OP_COPY);
+    lock_exclusive();
+    while (writable()) {
+        lease_recall_entry(dst_pinum, name);
+        if (recalled == NULL) {
+            break;
+        }
+        deliver_recalls();
     }
-
-    // Update parent directory size
-    parent_inode.size -= sizeof(dir_ent_t);
-    if (put_inode(pinum, &parent_inode) != 0) {
-        return -1;
+    int rc = writable() ? fs_copy(src_inum, dst_pinum, name, offset, nbytes) : -1;
+    if (unlock_commit() != 0) {
+        rc = -1;
     }
-
-    return 0;
+    op_end(OP_COPY, start, rc < 0);
+    return rc;
 }
 
-// ... [MFS_Unlink and MFS_Shutdown implementations] ...
+long MFS_Defrag(long budget) {
+    unsigned long start = op_begin(OP_DEFRAG);
+    lock_exclusive();
+    long rc = (writable() && budget > 0) ? fs_defrag(budget) : -1;
+    unlock_volume();
+    op_end(OP_DEFRAG, start, rc < 0);
+    return rc;
+}
 
+// Fails like MFS_Unmount: the volume stays mounted while another thread has
+// it selected, and a failed final commit is reported too
 int MFS_Shutdown() {
-    if (fs_fd != -1) {
-        close(fs_fd);
-        fs_fd = -1;
-    }
-    free(fs_image_path);
-    return 0;
+    unsigned long start = op_begin(OP_SHUTDOWN);
+    int rc = (vol != NULL) ? MFS_Unmount(vol->id) : 0;
+    op_end(OP_SHUTDOWN, start, rc < 0);
+    return rc;
 }
 
 
@@ -549,6 +3699,109 @@ void print_superblock(super_t *s) {
 }
 
 
+static int recalls[8];
+static char seen[8][3];
+static int unstick;
+
+// Runs while the change waits without the lock, so it may call back in and
+// still sees what the holder cached. Holder 5 does not answer until told.
+static void count_recall(int holder, int inum, void *arg) {
+    if (inum != 0) {
+        assert(MFS_Read(inum, seen[holder], 0, 3) == 3);
+    }
+    while (holder == 5 && !__atomic_load_n(&unstick, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    recalls[holder]++;
+}
+
+static char *deltas[64];
+static int delta_lens[64];
+static int delta_count;
+
+// Backups apply on their own thread; here the deltas are just queued
+static void queue_delta(const char *delta, int len, void *arg) {
+    assert(delta_count < 64);
+    deltas[delta_count] = malloc(len);
+    memcpy(deltas[delta_count], delta, len);
+    delta_lens[delta_count++] = len;
+}
+
+static int backup_result = -1;
+
+static void *backup_worker(void *arg) {
+    char buf[100];
+    MFS_Stat_t st;
+    assert(MFS_Use((int) (long) arg) == 0 && MFS_Replica(1) == 0);
+    assert(MFS_ApplyDelta(deltas[1], delta_lens[1]) == -1);     // A copy starts at 1
+    for (int i = 0; i < delta_count; i++) {
+        assert(MFS_ApplyDelta(deltas[i], delta_lens[i]) > 0);
+        assert(MFS_ApplyDelta(deltas[i], delta_lens[i]) > 0);  // Resend is harmless
+    }
+    // A remounted primary numbers from 1 again, under another stream id
+    delta_hdr_t *h = (delta_hdr_t *) deltas[0];
+    h->stream++;
+    assert(MFS_ApplyDelta(deltas[0], delta_lens[0]) == -1);
+    h->seq = delta_count + 1;
+    assert(MFS_ApplyDelta(deltas[0], delta_lens[0]) == -1);
+    for (int i = 0; i < delta_count; i++) {
+        free(deltas[i]);
+    }
+    int rep = MFS_Lookup(0, "rep");
+    int file = MFS_Lookup(rep, "file");
+    assert(rep > 0 && file > 0 && MFS_Lookup(0, "gone") == -1);
+    assert(MFS_Stat(file, &st) == 0 && st.size == 100);
+    assert(MFS_Read(file, buf, 0, 100) == 100 && memcmp(buf, "replicated", 10) == 0);
+    assert(MFS_Creat(rep, UFS_REGULAR_FILE, "refused") == -1);
+    assert(MFS_Replica(0) == 0);
+    assert(MFS_Creat(rep, UFS_REGULAR_FILE, "promoted") == 0);
+    backup_result = 0;
+    return NULL;
+}
+
+static int volume_worker_result = -1;
+
+static void *volume_worker(void *arg) {
+    if (MFS_Use((int) (long) arg) == 0) {
+        volume_worker_result = MFS_Lookup(0, "orig");
+    }
+    return NULL;
+}
+
+static int unmount_result;
+
+static void *unmounter(void *arg) {
+    unmount_result = MFS_Unmount((int) (long) arg);
+    return NULL;
+}
+
+#define SHARERS (4)
+
+static int shared_volume;
+static int sharer_result[SHARERS];
+
+// One of several threads changing and reading the same volume at once
+static void *sharer(void *arg) {
+    int t = (int) (long) arg;
+    char name[28], block[2 * UFS_BLOCK_SIZE], back[2 * UFS_BLOCK_SIZE];
+    sprintf(name, "t%d", t);
+    if (MFS_Use(shared_volume) != 0 || MFS_Creat(0, UFS_REGULAR_FILE, name) != 0) {
+        return NULL;
+    }
+    int inum = MFS_Lookup(0, name);
+    for (int round = 0; round < 20; round++) {
+        memset(block, 'A' + t, sizeof(block));
+        block[0] = round;
+        if (MFS_Write(inum, block, 0, sizeof(block)) != sizeof(block) ||
+            MFS_Read(inum, back, 0, sizeof(back)) != sizeof(back) ||
+            memcmp(block, back, sizeof(block)) != 0 || MFS_Lookup(0, name) != inum) {
+            return NULL;
+        }
+    }
+    sharer_result[t] = 1;
+    return NULL;
+}
+
 int test(void) {
     puts("----------->WARNING: RUN ON EMPTY DISK<------------");
     srand(time(NULL));
@@ -561,44 +3814,630 @@ int test(void) {
 
     printf("Lookup passed") ; 
 
-    // Make directory /dir
+    // Make directory /dir. Inode numbers depend on placement, so only check
+    // that each new name got its own inode, and files sit next to their parent
     assert(MFS_Creat(0, UFS_DIRECTORY, "dir") == 0);
-    assert(MFS_Lookup(0, "dir") == 1);
+    int dir = MFS_Lookup(0, "dir");
+    assert(dir > 0);
 
      printf("Create passed") ; 
 
     // Make directory /dir/dir2
-    assert(MFS_Creat(1, UFS_DIRECTORY, "dir2") == 0);
-    assert(MFS_Lookup(1, "dir2") == 2);
+    assert(MFS_Creat(dir, UFS_DIRECTORY, "dir2") == 0);
+    int dir2 = MFS_Lookup(dir, "dir2");
+    assert(dir2 > 0 && dir2 != dir);
 
     printf("Create dir passed") ;
 
     // Create file /file1
     assert(MFS_Creat(0, UFS_REGULAR_FILE, "file1") == 0);
-    assert(MFS_Lookup(0, "file1") == 3);
+    int file1 = MFS_Lookup(0, "file1");
+    assert(file1 > 0 && file1 != dir && file1 != dir2);
 
     printf("Create regular passed") ;
 
     // Create file /dir/file2
-    assert(MFS_Creat(1, UFS_REGULAR_FILE, "file2") == 0);
-    assert(MFS_Lookup(1, "file2") == 4);
+    assert(MFS_Creat(dir, UFS_REGULAR_FILE, "file2") == 0);
+    int file2 = MFS_Lookup(dir, "file2");
+    assert(file2 > 0 && file2 != dir && file2 != dir2 && file2 != file1);
+    assert(vol->superblock.num_inodes < 512 || file2 / INODES_PER_BLOCK == dir / INODES_PER_BLOCK);
 
     // Unlink file /file1
     assert(MFS_Unlink(0, "file1") == 0);
     assert(MFS_Lookup(0, "file1") == -1);
     printf("Unlink passed") ;
     // Unlink directory /dir/dir2
-    assert(MFS_Unlink(1, "dir2") == 0);
-    assert(MFS_Lookup(1, "dir2") == -1);
+    assert(MFS_Unlink(dir, "dir2") == 0);
+    assert(MFS_Lookup(dir, "dir2") == -1);
     printf("Unlink 2  passed") ;
 
+    // Remove /dir with everything under it in one call
+    assert(MFS_Creat(dir, UFS_DIRECTORY, "sub") == 0);
+    assert(MFS_Creat(MFS_Lookup(dir, "sub"), UFS_REGULAR_FILE, "leaf") == 0);
+    assert(MFS_Unlink(0, "dir") == -1);
+    assert(MFS_RemoveTree(0, "dir") == 0);
+    assert(MFS_Lookup(0, "dir") == -1);
+    printf("RemoveTree passed") ;
+
+    // Fill the root past one block so it has to grow, then empty it again
+    // (needs an image with room for 300 files, e.g. mkfs -f fs4 -i 512)
+    char name[28];
+    for (int i = 0; i < 300 && vol->superblock.num_inodes >= 512; i++) {
+        sprintf(name, "f%d", i);
+        assert(MFS_Creat(0, UFS_REGULAR_FILE, name) == 0);
+    }
+    MFS_Stat_t st;
+    pthread_t tid;
+    assert(MFS_Stat(0, &st) == 0 && (vol->superblock.num_inodes < 512 || st.size == 302 * sizeof(dir_ent_t)));
+    for (int i = 0; i < 300 && vol->superblock.num_inodes >= 512; i++) {
+        sprintf(name, "f%d", i);
+        assert(MFS_Lookup(0, name) >= 0);
+        assert(MFS_Unlink(0, name) == 0);
+    }
+    assert(MFS_Stat(0, &st) == 0 && st.size == 2 * sizeof(dir_ent_t));
+    printf("Directory growth passed") ;
+
+    // Server-side copies, whole file and an unaligned range
+    char *data = malloc(10000);
+    char *back = malloc(10000);
+    for (int i = 0; i < 10000; i++) {
+        data[i] = 'a' + rand() % 26;
+    }
+    assert(MFS_Creat(0, UFS_REGULAR_FILE, "orig") == 0);
+    int orig = MFS_Lookup(0, "orig");
+    assert(MFS_Write(orig, data, 0, 10000) == 10000);
+    assert(MFS_Copy(orig, 0, "copy") == 0);
+    assert(MFS_Stat(MFS_Lookup(0, "copy"), &st) == 0 && st.size == 10000);
+    assert(MFS_Read(MFS_Lookup(0, "copy"), back, 0, 10000) == 10000);
+    assert(memcmp(data, back, 10000) == 0);
+    assert(MFS_CopyRange(orig, 0, "part", 1000, 5000) == 0);
+    assert(MFS_Read(MFS_Lookup(0, "part"), back, 0, 5000) == 5000);
+    assert(memcmp(data + 1000, back, 5000) == 0);
+    // Past an aligned range the copy reads as zeros once a write extends it
+    assert(MFS_CopyRange(orig, 0, "head", 0, 100) == 0);
+    int head = MFS_Lookup(0, "head");
+    assert(MFS_Write(head, "z", 200, 1) == 1 && MFS_Read(head, back, 0, 201) == 201);
+    assert(memcmp(back, data, 100) == 0 && back[100] == 0 && back[199] == 0 && back[200] == 'z');
+    assert(MFS_CopyRange(orig, 0, "head", 9000, INT_MAX) == 0);
+    assert(MFS_Stat(head, &st) == 0 && st.size == 1000 && MFS_Unlink(0, "head") == 0);
+    // A copy that fails leaves the file it would have replaced alone
+    unsigned int first_block = vol->inode_table[orig].direct[0];
+    vol->inode_table[orig].direct[0] = 1u << 30;
+    assert(MFS_CopyRange(orig, 0, "part", 0, 5000) == -1);
+    vol->inode_table[orig].direct[0] = first_block;
+    assert(MFS_Read(MFS_Lookup(0, "part"), back, 0, 5000) == 5000);
+    assert(memcmp(data + 1000, back, 5000) == 0);
+    printf("Copy passed") ;
+
+    // Mapped reads describe the same bytes MFS_Read copies
+    struct iovec iov[DIRECT_PTRS];
+    int n = MFS_ReadMap(orig, 100, 9000, iov, DIRECT_PTRS);
+    assert(n > 0);
+    int pos = 100;
+    for (int i = 0; i < n; i++) {
+        assert(memcmp(iov[i].iov_base, data + pos, iov[i].iov_len) == 0);
+        pos += iov[i].iov_len;
+    }
+    assert(pos == 9100);
+    MFS_Stat_t whole;
+    assert(MFS_Stat(orig, &whole) == 0);
+    n = MFS_ReadMap(orig, 100, INT_MAX, iov, DIRECT_PTRS);     // Stops at the end
+    long mapped = 0;
+    for (int i = 0; i < n; i++) {
+        mapped += iov[i].iov_len;
+    }
+    assert(n > 0 && mapped == whole.size - 100);
+    // A block pointer past the image is refused, not mapped
+    unsigned int saved = vol->inode_table[orig].direct[1];
+    vol->inode_table[orig].direct[1] = 1u << 30;
+    assert(MFS_ReadMap(orig, 0, 9000, iov, DIRECT_PTRS) == -1);
+    vol->inode_table[orig].direct[1] = saved;
+    printf("ReadMap passed") ;
+
+    // Conflicting changes recall leases from every holder, once
+    assert(MFS_SetRecall(count_recall, NULL) == 0);
+    assert(MFS_Lease(1, orig, 30) == 0 && MFS_Lease(2, orig, 30) == 0 && MFS_Lease(3, 0, 30) == 0);
+    assert(MFS_Read(orig, back, 0, 100) == 100 && recalls[1] == 0);
+    assert(MFS_Write(orig, "new", 0, 3) == 3);
+    assert(recalls[1] == 1 && recalls[2] == 1 && recalls[3] == 0);
+    assert(memcmp(seen[1], data, 3) == 0 && memcmp(seen[2], data, 3) == 0);    // Told first
+    assert(MFS_Write(orig, data, 0, 100) == 100 && recalls[1] == 1);
+    // A holder that does not answer holds the change up until its lease ends
+    unsigned long asked = now_ns();
+    assert(MFS_Lease(5, orig, 1) == 0 && MFS_Write(orig, data, 0, 100) == 100);
+    assert(now_ns() - asked >= 900000000UL && recalls[5] == 0);
+    __atomic_store_n(&unstick, 1, __ATOMIC_RELEASE);
+    for (int users = 2; users > 1; sched_yield()) {
+        pthread_mutex_lock(&volumes_lock);
+        users = vol->users;
+        pthread_mutex_unlock(&volumes_lock);
+    }
+    assert(recalls[5] == 1);
+    assert(MFS_Creat(0, UFS_REGULAR_FILE, "orig") == 0 && recalls[3] == 0);
+    assert(MFS_Creat(0, UFS_REGULAR_FILE, "leased") == 0 && recalls[3] == 1);
+    assert(MFS_Lease(4, MFS_Lookup(0, "leased"), 30) == 0 && MFS_Release(4, MFS_Lookup(0, "leased")) == 0);
+    assert(MFS_Unlink(0, "leased") == 0 && recalls[4] == 0);
+    free(data);
+    free(back);
+    printf("Leases passed") ;
+
+    // Two files grown a block at a time in turn interleave; defrag makes
+    // each one run again without changing a byte
+    char blocks[2][4 * UFS_BLOCK_SIZE], copy[4 * UFS_BLOCK_SIZE];
+    int frag[2], count;
+    for (int f = 0; f < 2; f++) {
+        sprintf(name, "frag%d", f);
+        assert(MFS_Creat(0, UFS_REGULAR_FILE, name) == 0);
+        frag[f] = MFS_Lookup(0, name);
+        memset(blocks[f], 'x' + f, sizeof(blocks[f]));
+    }
+    for (int b = 0; b < 4; b++) {
+        for (int f = 0; f < 2; f++) {
+            blocks[f][b * UFS_BLOCK_SIZE] = '0' + b;
+            assert(MFS_Write(frag[f], blocks[f] + b * UFS_BLOCK_SIZE, b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE) == UFS_BLOCK_SIZE);
+        }
+    }
+    assert(extents_of(&vol->inode_table[frag[0]], &count) > 1 && count == 4);
+    long moved;
+    while ((moved = MFS_Defrag(8)) > 0) {
+    }
+    assert(moved == 0);
+    for (int f = 0; f < 2; f++) {
+        assert(extents_of(&vol->inode_table[frag[f]], &count) == 1 && count == 4);
+        assert(MFS_Read(frag[f], copy, 0, sizeof(copy)) == sizeof(copy));
+        assert(memcmp(copy, blocks[f], sizeof(copy)) == 0);
+        sprintf(name, "frag%d", f);
+        assert(MFS_Unlink(0, name) == 0);
+    }
+    printf("Defrag passed") ;
+
+    // With change tracking on (MFS_CBT=1) a write marks the block it changes
+    if (vol->cbt_map != NULL) {
+        unsigned int *bits = (unsigned int *) (vol->cbt_map + UFS_BLOCK_SIZE);
+        unsigned int b = vol->inode_table[orig].direct[0];
+        bits[b / 32] &= ~(0x1u << (31 - b % 32));
+        assert(MFS_Write(orig, "x", 0, 1) == 1);
+        assert(bits[b / 32] & (0x1u << (31 - b % 32)));
+        // A bit whose sync failed is synced again by the retry
+        int fd = vol->cbt_fd;
+        bits[b / 32] &= ~(0x1u << (31 - b % 32));
+        vol->cbt_fd = -1;
+        assert(MFS_Write(orig, "x", 0, 1) == -1 && vol->cbt_unsynced);
+        vol->cbt_fd = fd;
+        assert(MFS_Write(orig, "x", 0, 1) == 1 && !vol->cbt_unsynced);
+        printf("Change tracking passed") ;
+    }
+
+    // A copy of the image follows the primary by applying its deltas
+    int in = open("fs4", O_RDONLY), out = open("fs4.replica", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char chunk[1 << 16];
+    ssize_t got;
+    while ((got = read(in, chunk, sizeof(chunk))) > 0) {
+        assert(write(out, chunk, got) == got);
+    }
+    close(in);
+    close(out);
+    int backup = MFS_Mount("fs4.replica");
+    assert(backup >= 0 && MFS_SetReplicator(queue_delta, NULL) == 0);
+    char payload[100] = "replicated";
+    assert(MFS_Creat(0, UFS_DIRECTORY, "rep") == 0);
+    assert(MFS_Creat(MFS_Lookup(0, "rep"), UFS_REGULAR_FILE, "file") == 0);
+    assert(MFS_Write(MFS_Lookup(MFS_Lookup(0, "rep"), "file"), payload, 0, 100) == 100);
+    assert(MFS_Creat(0, UFS_REGULAR_FILE, "gone") == 0 && MFS_Unlink(0, "gone") == 0);
+    assert(MFS_SetReplicator(NULL, NULL) == 0);
+    assert(pthread_create(&tid, NULL, backup_worker, (void *) (long) backup) == 0);
+    assert(pthread_join(tid, NULL) == 0 && backup_result == 0);
+    assert(MFS_Unmount(backup) == 0);
+    unlink("fs4.replica");
+    unlink("fs4.replica.cbt");
+
+    // A change whose delta cannot be built still uses up its number
+    delta_count = 0;
+    assert(MFS_SetReplicator(queue_delta, NULL) == 0);
+    events_lost = 1;
+    assert(MFS_Creat(0, UFS_REGULAR_FILE, "lost") == 0 && delta_count == 0);
+    assert(MFS_Unlink(0, "lost") == 0 && delta_count == 1);
+    assert(((delta_hdr_t *) deltas[0])->seq == 2);
+    assert(MFS_SetReplicator(NULL, NULL) == 0);
+    free(deltas[0]);
+    printf("Replication passed") ;
+
+    // A second volume, used from its own thread, leaves ours alone
+    int second = MFS_Mount("fs4");
+    assert(second >= 0);
+    assert(pthread_create(&tid, NULL, volume_worker, (void *) (long) second) == 0);
+    assert(pthread_join(tid, NULL) == 0);
+    assert(volume_worker_result == orig);
+    int ours = vol->id;
+    assert(MFS_Use(second) == 0);
+    assert(pthread_create(&tid, NULL, unmounter, (void *) (long) second) == 0);
+    assert(pthread_join(tid, NULL) == 0 && unmount_result == -1);   // Still ours
+    assert(MFS_Use(ours) == 0 && MFS_Unmount(second) == 0);
+    assert(MFS_Lookup(0, "orig") == orig);
+    printf("Volumes passed") ;
+
+    // Several threads on this volume at once each see their own changes
+    pthread_t sharers[SHARERS];
+    shared_volume = vol->id;
+    for (int t = 0; t < SHARERS; t++) {
+        assert(pthread_create(&sharers[t], NULL, sharer, (void *) (long) t) == 0);
+    }
+    for (int t = 0; t < SHARERS; t++) {
+        assert(pthread_join(sharers[t], NULL) == 0 && sharer_result[t] == 1);
+        sprintf(name, "t%d", t);
+        assert(MFS_Stat(MFS_Lookup(0, name), &st) == 0 && st.size == 2 * UFS_BLOCK_SIZE);
+        assert(MFS_Unlink(0, name) == 0);
+    }
+    printf("Threads passed") ;
+
+    char report[4096];
+    assert(MFS_Stats(report, sizeof(report)) > 0);
+    printf("\n%s", report);
+
     // Cleanup
+    assert(MFS_Shutdown() == 0);
+
+    return 0;
+}
+
+static void *drain(void *arg) {
+    char sink[1 << 16];
+    while (read(*(int *) arg, sink, sizeof(sink)) > 0) {
+    }
+    return NULL;
+}
+
+static double cpu_seconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// Sends 1 GB of replies for a full-size file over a local socket, once
+// copied out with MFS_Read and once gathered straight from the mapped image
+// with MFS_ReadMap, and reports throughput and CPU time per gigabyte
+static int read_bench(char *image) {
+    if (MFS_Init(image, 0) != 0) {
+        return 1;
+    }
+    static char data[DIRECT_PTRS * UFS_BLOCK_SIZE];
+    memset(data, 'r', sizeof(data));
+    if (MFS_Lookup(0, "readbench") < 0 && MFS_Creat(0, UFS_REGULAR_FILE, "readbench") != 0) {
+        return 1;
+    }
+    int inum = MFS_Lookup(0, "readbench");
+    if (MFS_Write(inum, data, 0, sizeof(data)) != sizeof(data)) {
+        return 1;
+    }
+
+    long rounds = (1L << 30) / sizeof(data);
+    for (int mapped = 0; mapped <= 1; mapped++) {
+        int sv[2];
+        pthread_t tid;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 ||
+            pthread_create(&tid, NULL, drain, &sv[1]) != 0) {
+            return 1;
+        }
+        unsigned long start = now_ns();
+        double cpu = cpu_seconds();
+        for (long r = 0; r < rounds; r++) {
+            for (int off = 0; off < (int) sizeof(data); off += UFS_BLOCK_SIZE) {
+                // One block per reply, as the 4 KB MFS_Read messages carry
+                struct iovec iov[2];
+                int n;
+                if (mapped) {
+                    n = MFS_ReadMap(inum, off, UFS_BLOCK_SIZE, iov, 2);
+                } else {
+                    iov[0].iov_base = data;
+                    iov[0].iov_len = MFS_Read(inum, data, off, UFS_BLOCK_SIZE);
+                    n = 1;
+                }
+                if (n < 1 || writev(sv[0], iov, n) < 0) {
+                    return 1;
+                }
+            }
+        }
+        close(sv[0]);
+        pthread_join(tid, NULL);
+        close(sv[1]);
+        double secs = (now_ns() - start) / 1e9;
+        double gb = rounds * sizeof(data) / 1e9;
+        printf("%-7s %8.1f MB/s  %6.3f cpu s/GB\n", mapped ? "mapped" : "copy",
+               gb * 1000 / secs, (cpu_seconds() - cpu) / gb);
+    }
+    MFS_Unlink(0, "readbench");
+    MFS_Shutdown();
+    return 0;
+}
+
+// Ages a fresh image with interleaved creates and unlinks spread over
+// several directories, then lists each directory the way a client does
+// (every entry looked up and stated) and reports how many inode-table
+// blocks that touches against the minimum for its size, and how far file
+// data lies from its directory's first block
+static int placement_bench(char *image) {
+    if (MFS_Init(image, 0) != 0) {
+        return 1;
+    }
+    enum { DIRS = 16, ROUNDS = 6 };
+    int per_round = (vol->superblock.num_inodes - 2 * DIRS) / (DIRS * ROUNDS);
+    if (per_round < 2 || vol->superblock.num_data < vol->superblock.num_inodes) {
+        fprintf(stderr, "need a fresh image with more inodes, e.g. mkfs -i 8192 -d 16384\n");
+        return 1;
+    }
+    char name[28], block[UFS_BLOCK_SIZE];
+    memset(block, 'p', sizeof(block));
+    int dirs[DIRS];
+    srand(1);
+    for (int d = 0; d < DIRS; d++) {
+        sprintf(name, "d%d", d);
+        if (MFS_Creat(0, UFS_DIRECTORY, name) != 0) {
+            return 1;
+        }
+        dirs[d] = MFS_Lookup(0, name);
+    }
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < per_round; i++) {
+            for (int d = 0; d < DIRS; d++) {
+                sprintf(name, "r%df%d", r, i);
+                if (MFS_Creat(dirs[d], UFS_REGULAR_FILE, name) != 0 ||
+                    MFS_Write(MFS_Lookup(dirs[d], name), block, 0, UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE) {
+                    return 1;
+                }
+            }
+        }
+        for (int i = 0; i < per_round; i++) {
+            for (int d = 0; d < DIRS; d++) {
+                sprintf(name, "r%df%d", r, i);
+                if (rand() % 2) {
+                    MFS_Unlink(dirs[d], name);
+                }
+            }
+        }
+    }
+
+    double touched = 0, minimum = 0, distance = 0;
+    long files = 0;
+    char *seen = calloc(vol->superblock.inode_region_len, 1);
+    for (int d = 0; d < DIRS; d++) {
+        inode_t dir = vol->inode_table[dirs[d]];
+        memset(seen, 0, vol->superblock.inode_region_len);
+        seen[dirs[d] / INODES_PER_BLOCK] = 1;
+        int blocks = 1, entries = 1;
+        for (int b = 0; b < DIRECT_PTRS && dir.direct[b] != -1; b++) {
+            dir_ent_t ents[ENTRIES_PER_BLOCK];
+            read_block(dir.direct[b], ents);
+            for (int e = 0; e < ENTRIES_PER_BLOCK; e++) {
+                if (ents[e].inum < 0 || ents[e].name[0] == '.') {
+                    continue;
+                }
+                entries++;
+                if (!seen[ents[e].inum / INODES_PER_BLOCK]) {
+                    seen[ents[e].inum / INODES_PER_BLOCK] = 1;
+                    blocks++;
+                }
+                inode_t f = vol->inode_table[ents[e].inum];
+                distance += labs((long) f.direct[0] - (long) dir.direct[0]);
+                files++;
+            }
+        }
+        touched += blocks;
+        minimum += (entries + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    }
+    free(seen);
+    printf("placement %s: %.2f inode blocks per listing (minimum %.2f), data %.1f blocks from its directory\n",
+           placement_lowest ? "lowest" : "near", touched / DIRS, minimum / DIRS, files ? distance / files : 0);
     MFS_Shutdown();
+    return 0;
+}
+
+#define BENCH_OPS (20000)
+
+static int bench_volume;
+
+// Reads, stats and looks up its own file, rewriting a block of it every
+// tenth op
+static void *bench_worker(void *arg) {
+    char name[28], block[UFS_BLOCK_SIZE];
+    sprintf(name, "bench%ld", (long) arg);
+    memset(block, 'b', sizeof(block));
+    MFS_Stat_t st;
+    if (MFS_Use(bench_volume) != 0 ||
+        (MFS_Lookup(0, name) < 0 && MFS_Creat(0, UFS_REGULAR_FILE, name) != 0)) {
+        return (void *) 1;
+    }
+    int inum = MFS_Lookup(0, name);
+    for (int b = 0; b < 4; b++) {
+        MFS_Write(inum, block, b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
+    }
+    for (int i = 0; i < BENCH_OPS; i++) {
+        int rc;
+        switch (i % 10) {
+        case 0:
+            rc = MFS_Write(inum, block, (i / 10 % 4) * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
+            break;
+        case 1: case 4: case 7:
+            rc = MFS_Stat(inum, &st);
+            break;
+        case 2: case 5: case 8:
+            rc = MFS_Lookup(0, name);
+            break;
+        default:
+            rc = MFS_Read(inum, block, (i % 4) * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
+        }
+        if (rc < 0) {
+            return (void *) 1;
+        }
+    }
+    return NULL;
+}
 
+// Throughput of 1 to 8 threads sharing one volume, with how many image
+// syncs their writes took
+static int thread_bench(char *image) {
+    if (MFS_Init(image, 0) != 0) {
+        return 1;
+    }
+    bench_volume = vol->id;
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        pthread_t tids[8];
+        thread_stats_t before, after;
+        stats_sum(&before);
+        unsigned long start = now_ns();
+        for (long t = 0; t < threads; t++) {
+            if (pthread_create(&tids[t], NULL, bench_worker, (void *) t) != 0) {
+                return 1;
+            }
+        }
+        int failed = 0;
+        for (int t = 0; t < threads; t++) {
+            void *rc;
+            pthread_join(tids[t], &rc);
+            failed |= (rc != NULL);
+        }
+        if (failed) {
+            return 1;
+        }
+        double secs = (now_ns() - start) / 1e9;
+        stats_sum(&after);
+        printf("%d threads %10.0f ops/s  %6.2f writes per fdatasync\n", threads,
+               threads * (double) BENCH_OPS / secs,
+               (double) (after.op_count[OP_WRITE] - before.op_count[OP_WRITE]) /
+               (after.fsyncs - before.fsyncs ? after.fsyncs - before.fsyncs : 1));
+    }
+    char name[28];
+    for (int t = 0; t < 8; t++) {
+        sprintf(name, "bench%d", t);
+        MFS_Unlink(0, name);
+    }
+    MFS_Shutdown();
     return 0;
 }
 
-int main() {
+// Extents per file, over the files (and directories) with any data
+static void print_fragmentation(const char *when) {
+    long files = 0, fragmented = 0, extents = 0;
+    for (int inum = 0; inum < vol->superblock.num_inodes; inum++) {
+        int count;
+        int n = bit_test(&vol->inode_map, inum) ? extents_of(&vol->inode_table[inum], &count) : 0;
+        if (n > 0) {
+            files++;
+            fragmented += (n > 1);
+            extents += n;
+        }
+    }
+    printf("%-7s %ld files, %ld fragmented, %.2f extents per file\n", when, files, fragmented,
+           files ? (double) extents / files : 0);
+}
+
+// Offline defragmentation: moves everything that can be moved, a budget's
+// worth per call as a live server would
+static int defrag_image(char *image) {
+    if (MFS_Init(image, 0) != 0) {
+        return 1;
+    }
+    print_fragmentation("before");
+    unsigned long start = now_ns();
+    long total = 0, moved;
+    while ((moved = MFS_Defrag(1024)) > 0) {
+        total += moved;
+    }
+    print_fragmentation("after");
+    printf("moved %ld blocks in %.3f s\n", total, (now_ns() - start) / 1e9);
+    MFS_Shutdown();
+    return moved < 0;
+}
+
+// Writes a file whose blocks lie past the 2 GB mark of a large image (the
+// lower blocks are marked in use in memory only, so nothing is persisted
+// for them), reads it back both ways, and checks that block numbers past
+// the end of the image are refused
+static int large_image_test(char *image) {
+    if (MFS_Init(image, 0) != 0) {
+        return 1;
+    }
+    int num_data = vol->superblock.num_data;
+    if ((off_t) vol->superblock.data_region_addr * UFS_BLOCK_SIZE + (off_t) num_data * UFS_BLOCK_SIZE < (3L << 30) ||
+        vol->free_blocks != num_data - 1) {
+        fprintf(stderr, "need a fresh image over 3 GB, e.g. mkfs -d 1048576\n");
+        return 1;
+    }
+    bitmap_t *map = &vol->data_map;
+    int last_group = (num_data - 1) / GROUP_BITS;
+    int words = (num_data - 64) / 32;
+    unsigned int first = map->words[0];
+    memset(map->words, 0xff, words * sizeof(unsigned int));
+    resummarize(map, 0, last_group);
+
+    static char data[DIRECT_PTRS * UFS_BLOCK_SIZE], back[DIRECT_PTRS * UFS_BLOCK_SIZE];
+    for (int i = 0; i < (int) sizeof(data); i++) {
+        data[i] = i * 7 + i / UFS_BLOCK_SIZE;
+    }
+    int ok = MFS_Creat(0, UFS_REGULAR_FILE, "large") == 0;
+    int inum = MFS_Lookup(0, "large");
+    ok = ok && inum > 0 && MFS_Write(inum, data, 0, sizeof(data)) == sizeof(data);
+    for (int b = 0; ok && b < DIRECT_PTRS; b++) {
+        ok = (off_t) vol->inode_table[inum].direct[b] * UFS_BLOCK_SIZE > (2L << 30);
+    }
+    ok = ok && MFS_Read(inum, back, 0, sizeof(back)) == sizeof(back) && memcmp(data, back, sizeof(data)) == 0;
+    struct iovec iov[DIRECT_PTRS];
+    int n = ok ? MFS_ReadMap(inum, 0, sizeof(data), iov, DIRECT_PTRS) : -1;
+    for (int i = 0, off = 0; ok && i < n; off += iov[i].iov_len, i++) {
+        ok = memcmp(iov[i].iov_base, data + off, iov[i].iov_len) == 0;
+    }
+    int end = vol->superblock.data_region_addr + num_data;
+    ok = ok && n > 0 && read_block(end, back) == -1 && write_block(end, back) == -1 &&
+         read_block(-1, back) == -1 && read_block(end - 1, back) == UFS_BLOCK_SIZE;
+    ok = MFS_Unlink(0, "large") == 0 && ok;
+
+    memset(map->words, 0, words * sizeof(unsigned int));
+    map->words[0] = first;
+    resummarize(map, 0, last_group);
+    ok = ok && vol->free_blocks == num_data - 1;
+    MFS_Shutdown();
+    printf("large image: %s\n", ok ? "passed" : "FAILED");
+    return !ok;
+}
+
+// filemgr            run the self test against fs4
+// filemgr -L <image> check file I/O past 2 GB on a large fresh image
+// filemgr -D <image> defragment the image offline
+// filemgr -t <image> throughput of threads sharing one volume
+// filemgr -s <image> boot the image and report startup time per phase
+// filemgr -r <image> compare copied and mapped read replies
+// filemgr -l <image> age a fresh image and report placement locality
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "-t") == 0) {
+        return thread_bench(argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "-D") == 0) {
+        return defrag_image(argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "-L") == 0) {
+        return large_image_test(argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "-l") == 0) {
+        return placement_bench(argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "-r") == 0) {
+        return read_bench(argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+        if (MFS_Init(argv[2], 0) != 0) {
+            return 1;
+        }
+        printf("%d inodes (%ld free), %d data blocks (%ld free)\n",
+               vol->superblock.num_inodes, vol->free_inodes, vol->superblock.num_data, vol->free_blocks);
+        printf("  superblock  %8.2f ms\n", startup.superblock);
+        printf("  metadata    %8.2f ms\n", startup.metadata);
+        printf("  summaries   %8.2f ms\n", startup.summaries);
+        printf("  dir index   %8.2f ms (slowest of %d threads)\n", startup.dir_index, startup.threads - 1);
+        printf("  warm total  %8.2f ms\n", startup.warm);
+        printf("  total       %8.2f ms\n", startup.total);
+        MFS_Shutdown();
+        return 0;
+    }
+
     test() ; 
     
     
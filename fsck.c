@@ -0,0 +1,488 @@
+// fsck.c: offline consistency checker for a file system image
+//
+// The image is mapped into memory and checked in three parallel passes:
+//   1. every allocated inode: type, size, direct[] pointers, and (for
+//      directories) every entry, counting references to inodes and blocks
+//   2. every inode: bitmap vs. references, and "." / ".." vs. the directory
+//      that actually holds it
+//   3. every data block: bitmap vs. references
+// Work is handed out in fixed-size chunks so threads stay busy on images
+// where allocated inodes are clustered.
+//
+// Exit status follows fsck(8): 0 clean, 1 problems repaired, 4 problems left,
+// 8 operational error; 2 means the superblock is unusable and nothing was checked.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "ufs.h"
+
+#define CHUNK (4096)   // inodes or blocks per unit of work
+#define ENTRIES_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(dir_ent_t))
+
+static char *image;
+static super_t sb;
+static int repair;
+static int verbose;
+
+static unsigned int *inode_bitmap;
+static unsigned int *data_bitmap;
+static inode_t *inodes;
+
+static int *links;      // entries naming an inode, not counting "." and ".."
+static int *parent;     // directory holding the (last seen) entry for an inode
+static int *dotdot;     // what a directory's ".." says its parent is
+static int *block_refs; // direct[] pointers naming each data block
+static char *reclaimed; // inodes counted as part of a leaked subtree
+
+static int next_chunk;
+
+static long errors;     // problems we do not know how to repair
+static long leaks;      // allocated but unreferenced inodes and blocks
+static long repaired;
+
+static void problem(long *counter, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void problem(long *counter, const char *fmt, ...) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+    if (counter == &leaks && !verbose) {
+        return;
+    }
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    printf("%s\n", line);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Bitmaps use the mkfs layout: bit i is (0x1 << (31 - i % 32)) of word i / 32
+static int bit_test(unsigned int *bitmap, int index) {
+    return (bitmap[index / 32] >> (31 - index % 32)) & 0x1;
+}
+
+static void bit_clear(unsigned int *bitmap, int index) {
+    __atomic_fetch_and(&bitmap[index / 32], ~(0x1u << (31 - index % 32)), __ATOMIC_RELAXED);
+}
+
+static int valid_block(unsigned int block) {
+    return block >= (unsigned int) sb.data_region_addr && block < (unsigned int) (sb.data_region_addr + sb.num_data);
+}
+
+static int claim_chunk(int total) {
+    int start = __atomic_fetch_add(&next_chunk, CHUNK, __ATOMIC_RELAXED);
+    return (start < total) ? start : -1;
+}
+
+static void check_directory(int inum, inode_t *dir) {
+    int valid = 0;
+    int last = -1;
+    int have_dot = 0;
+
+    dotdot[inum] = -1;
+    for (int i = 0; i < DIRECT_PTRS; i++) {
+        if (dir->direct[i] == -1 || !valid_block(dir->direct[i])) {
+            continue;
+        }
+        dir_ent_t *entries = (dir_ent_t *) (image + (off_t) dir->direct[i] * UFS_BLOCK_SIZE);
+        for (int j = 0; j < ENTRIES_PER_BLOCK; j++) {
+            dir_ent_t *e = &entries[j];
+            if (e->inum == -1) {
+                continue;
+            }
+            valid++;
+            last = i * ENTRIES_PER_BLOCK + j;
+
+            if (memchr(e->name, '\0', sizeof(e->name)) == NULL) {
+                problem(&errors, "dir %d: entry %d name is not terminated", inum, last);
+                continue;
+            }
+            if (e->inum < 0 || e->inum >= sb.num_inodes) {
+                problem(&errors, "dir %d: entry '%s' has bad inode number %d", inum, e->name, e->inum);
+                continue;
+            }
+            if (!bit_test(inode_bitmap, e->inum)) {
+                problem(&errors, "dir %d: entry '%s' points to free inode %d", inum, e->name, e->inum);
+                continue;
+            }
+
+            if (strcmp(e->name, ".") == 0) {
+                have_dot = 1;
+                if (e->inum != inum) {
+                    problem(&errors, "dir %d: '.' points to %d", inum, e->inum);
+                }
+            } else if (strcmp(e->name, "..") == 0) {
+                dotdot[inum] = e->inum;
+                if (inodes[e->inum].type != UFS_DIRECTORY) {
+                    problem(&errors, "dir %d: '..' points to non-directory %d", inum, e->inum);
+                }
+            } else {
+                __atomic_fetch_add(&links[e->inum], 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&parent[e->inum], inum, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    if (!have_dot) {
+        problem(&errors, "dir %d: missing '.'", inum);
+    }
+    if (dotdot[inum] == -1) {
+        problem(&errors, "dir %d: missing '..'", inum);
+    }
+
+    // A directory spans up to DIRECT_PTRS blocks and keeps holes where
+    // entries were unlinked; its size is the end of the last used slot
+    // across those blocks, as the README defines it. mkfs -r packs entries,
+    // and images from before directories grew kept entries *
+    // sizeof(dir_ent_t), so that is accepted too.
+    int by_count = valid * sizeof(dir_ent_t);
+    int by_offset = (last + 1) * sizeof(dir_ent_t);
+    if (dir->size != by_count && dir->size != by_offset) {
+        problem(&errors, "dir %d: size %d, expected %d (%d entries)", inum, dir->size, by_count, valid);
+    }
+}
+
+// Pass 1: everything that can be checked by looking at one inode
+static void *check_inodes(void *arg) {
+    int start;
+    while ((start = claim_chunk(sb.num_inodes)) != -1) {
+        int end = (start + CHUNK < sb.num_inodes) ? start + CHUNK : sb.num_inodes;
+        for (int inum = start; inum < end; inum++) {
+            if (!bit_test(inode_bitmap, inum)) {
+                continue;
+            }
+            inode_t *inode = &inodes[inum];
+
+            if (inode->type != UFS_DIRECTORY && inode->type != UFS_REGULAR_FILE) {
+                problem(&errors, "inode %d: bad type %d", inum, inode->type);
+                continue;
+            }
+            if (inode->size < 0 || inode->size > DIRECT_PTRS * UFS_BLOCK_SIZE) {
+                problem(&errors, "inode %d: bad size %d", inum, inode->size);
+            }
+
+            for (int i = 0; i < DIRECT_PTRS; i++) {
+                unsigned int block = inode->direct[i];
+                if (block == -1) {
+                    continue;
+                }
+                if (!valid_block(block)) {
+                    problem(&errors, "inode %d: direct[%d] = %u is outside the data region", inum, i, block);
+                    continue;
+                }
+                __atomic_fetch_add(&block_refs[block - sb.data_region_addr], 1, __ATOMIC_RELAXED);
+            }
+
+            if (inode->type == UFS_DIRECTORY) {
+                check_directory(inum, inode);
+            }
+        }
+    }
+    return NULL;
+}
+
+// A leaked inode and, for a directory, everything it alone names. A crash
+// partway through removing a tree leaves the whole subtree unreachable, and
+// freeing just its top would only orphan the rest for the next run, so the
+// subtree is counted (and with -r freed) in one go. Its blocks lose their
+// references, so pass 3 frees them too.
+static void reclaim_tree(int top) {
+    int cap = 64, count = 0;
+    int *stack = malloc(cap * sizeof(int));
+    if (stack == NULL) {
+        perror("malloc");
+        exit(8);
+    }
+    stack[count++] = top;
+    while (count > 0) {
+        int inum = stack[--count];
+        if (__atomic_exchange_n(&reclaimed[inum], 1, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        inode_t *inode = &inodes[inum];
+        if (inum == top) {
+            problem(&leaks, "inode %d: allocated but not in any directory", inum);
+        } else {
+            problem(&leaks, "inode %d: only named by leaked directory %d", inum, parent[inum]);
+        }
+        if (inode->type == UFS_DIRECTORY) {
+            for (int i = 0; i < DIRECT_PTRS; i++) {
+                if (inode->direct[i] == -1 || !valid_block(inode->direct[i])) {
+                    continue;
+                }
+                dir_ent_t *entries = (dir_ent_t *) (image + (off_t) inode->direct[i] * UFS_BLOCK_SIZE);
+                for (int j = 0; j < ENTRIES_PER_BLOCK; j++) {
+                    int child = entries[j].inum;
+                    if (child <= 0 || child >= sb.num_inodes || child == inum ||
+                        memchr(entries[j].name, '\0', sizeof(entries[j].name)) == NULL ||
+                        strcmp(entries[j].name, ".") == 0 || strcmp(entries[j].name, "..") == 0 ||
+                        !bit_test(inode_bitmap, child) || links[child] != 1 || parent[child] != inum) {
+                        continue;
+                    }
+                    if (count == cap) {
+                        cap *= 2;
+                        stack = realloc(stack, cap * sizeof(int));
+                        if (stack == NULL) {
+                            perror("realloc");
+                            exit(8);
+                        }
+                    }
+                    stack[count++] = child;
+                }
+            }
+        }
+        if (repair) {
+            for (int i = 0; i < DIRECT_PTRS; i++) {
+                unsigned int block = inode->direct[i];
+                if (block != -1 && valid_block(block)) {
+                    __atomic_fetch_sub(&block_refs[block - sb.data_region_addr], 1, __ATOMIC_RELAXED);
+                }
+            }
+            bit_clear(inode_bitmap, inum);
+            __atomic_fetch_add(&repaired, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(stack);
+}
+
+// Pass 2: inode bitmap vs. directory references, and ".." vs. real parent
+static void *check_links(void *arg) {
+    int start;
+    while ((start = claim_chunk(sb.num_inodes)) != -1) {
+        int end = (start + CHUNK < sb.num_inodes) ? start + CHUNK : sb.num_inodes;
+        for (int inum = start; inum < end; inum++) {
+            if (!bit_test(inode_bitmap, inum) || inum == 0) {
+                continue;
+            }
+            inode_t *inode = &inodes[inum];
+
+            if (links[inum] == 0) {
+                reclaim_tree(inum);
+                continue;
+            }
+
+            if (inode->type == UFS_DIRECTORY) {
+                if (links[inum] > 1) {
+                    problem(&errors, "dir %d: named by %d entries", inum, links[inum]);
+                }
+                if (dotdot[inum] != -1 && dotdot[inum] != parent[inum]) {
+                    problem(&errors, "dir %d: '..' is %d but it lives in %d", inum, dotdot[inum], parent[inum]);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Pass 3: data bitmap vs. direct[] references
+static void *check_blocks(void *arg) {
+    int start;
+    while ((start = claim_chunk(sb.num_data)) != -1) {
+        int end = (start + CHUNK < sb.num_data) ? start + CHUNK : sb.num_data;
+        for (int b = start; b < end; b++) {
+            int used = bit_test(data_bitmap, b);
+            int refs = block_refs[b];
+            if (refs > 1) {
+                problem(&errors, "block %d: referenced by %d inodes", sb.data_region_addr + b, refs);
+            }
+            if (refs > 0 && !used) {
+                problem(&errors, "block %d: in use but free in bitmap", sb.data_region_addr + b);
+            }
+            if (refs == 0 && used) {
+                problem(&leaks, "block %d: allocated but unreferenced", sb.data_region_addr + b);
+                if (repair) {
+                    bit_clear(data_bitmap, b);
+                    __atomic_fetch_add(&repaired, 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static double run_pass(void *(*pass)(void *), int num_threads) {
+    double start = now();
+    pthread_t *tids = calloc(num_threads, sizeof(pthread_t));
+    next_chunk = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&tids[i], NULL, pass, NULL) != 0) {
+            perror("pthread_create");
+            exit(8);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    return now() - start;
+}
+
+// Everything later passes index the mapped image with must lie inside it:
+// the regions follow each other from block 1, as mkfs lays them out, each
+// bitmap has a bit per inode or block, and the last region ends within the
+// file. Sums and products are taken in 64 bits so garbage cannot wrap.
+static int check_superblock(off_t image_size) {
+    long bits_per_block = UFS_BLOCK_SIZE * 8;
+    long inodes_per_block = UFS_BLOCK_SIZE / sizeof(inode_t);
+    if (sb.num_inodes <= 0 || sb.num_data <= 0 ||
+        sb.inode_bitmap_len <= 0 || sb.data_bitmap_len <= 0 ||
+        sb.inode_region_len <= 0 || sb.data_region_len <= 0 ||
+        sb.inode_bitmap_addr != 1 ||
+        sb.data_bitmap_addr != (long) sb.inode_bitmap_addr + sb.inode_bitmap_len ||
+        sb.inode_region_addr != (long) sb.data_bitmap_addr + sb.data_bitmap_len ||
+        sb.data_region_addr != (long) sb.inode_region_addr + sb.inode_region_len) {
+        return -1;
+    }
+    if (sb.inode_bitmap_len * bits_per_block < sb.num_inodes ||
+        sb.data_bitmap_len * bits_per_block < sb.num_data ||
+        sb.inode_region_len * inodes_per_block < sb.num_inodes ||
+        sb.data_region_len < sb.num_data ||
+        (long) sb.data_region_addr + sb.data_region_len > INT_MAX) {
+        return -1;
+    }
+    if (((off_t) sb.data_region_addr + sb.data_region_len) * UFS_BLOCK_SIZE > image_size) {
+        return -1;
+    }
+    return 0;
+}
+
+// Repairs bypass the engine, so a changed-block sidecar cannot say which
+// blocks they touched: mark them all, making the next backup a full one
+static void mark_all_changed(char *image_file) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.cbt", image_file);
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= UFS_BLOCK_SIZE) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+        memset(map + UFS_BLOCK_SIZE, 0xff, st.st_size - UFS_BLOCK_SIZE);
+        if (msync(map, st.st_size, MS_SYNC) != 0) {
+            perror("msync");
+        }
+        munmap(map, st.st_size);
+    }
+    close(fd);
+}
+
+void usage() {
+    fprintf(stderr, "usage: fsck -f <image_file> [-j <threads>] [-r] [-v]\n");
+    exit(8);
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    char *image_file = NULL;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((ch = getopt(argc, argv, "f:j:rv")) != -1) {
+        switch (ch) {
+        case 'f':
+            image_file = optarg;
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+        case 'r':
+            repair = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (image_file == NULL || num_threads < 1) {
+        usage();
+    }
+
+    int fd = open(image_file, repair ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        exit(8);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < UFS_BLOCK_SIZE) {
+        fprintf(stderr, "image too small\n");
+        exit(8);
+    }
+
+    image = mmap(NULL, st.st_size, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        perror("mmap");
+        exit(8);
+    }
+    madvise(image, st.st_size, MADV_WILLNEED);
+
+    memcpy(&sb, image, sizeof(super_t));
+    if (check_superblock(st.st_size) != 0) {
+        fprintf(stderr, "bad superblock: regions overlap, leave the image or do not fit their counts\n");
+        exit(2);
+    }
+
+    inode_bitmap = (unsigned int *) (image + (off_t) sb.inode_bitmap_addr * UFS_BLOCK_SIZE);
+    data_bitmap = (unsigned int *) (image + (off_t) sb.data_bitmap_addr * UFS_BLOCK_SIZE);
+    inodes = (inode_t *) (image + (off_t) sb.inode_region_addr * UFS_BLOCK_SIZE);
+
+    links = calloc(sb.num_inodes, sizeof(int));
+    parent = calloc(sb.num_inodes, sizeof(int));
+    dotdot = calloc(sb.num_inodes, sizeof(int));
+    block_refs = calloc(sb.num_data, sizeof(int));
+    reclaimed = calloc(sb.num_inodes, 1);
+    if (links == NULL || parent == NULL || dotdot == NULL || block_refs == NULL || reclaimed == NULL) {
+        perror("calloc");
+        exit(8);
+    }
+
+    if (!bit_test(inode_bitmap, 0) || inodes[0].type != UFS_DIRECTORY) {
+        problem(&errors, "root inode 0 is not an allocated directory");
+    }
+
+    double t1 = run_pass(check_inodes, num_threads);
+    if (inodes[0].type == UFS_DIRECTORY && dotdot[0] != 0) {
+        problem(&errors, "dir 0: '..' is %d, root must be its own parent", dotdot[0]);
+    }
+    double t2 = run_pass(check_links, num_threads);
+    double t3 = run_pass(check_blocks, num_threads);
+
+    if (repaired > 0 && msync(image, st.st_size, MS_SYNC) != 0) {
+        perror("msync");
+        exit(8);
+    }
+    if (repaired > 0) {
+        mark_all_changed(image_file);
+    }
+
+    printf("%d inodes, %d data blocks, %d threads\n", sb.num_inodes, sb.num_data, num_threads);
+    printf("  inodes   %.3f s\n  links    %.3f s\n  blocks   %.3f s\n", t1, t2, t3);
+    printf("%ld errors, %ld leaks, %ld repaired\n", errors, leaks, repaired);
+
+    munmap(image, st.st_size);
+    close(fd);
+
+    if (errors > 0 || leaks > repaired) {
+        return 4;
+    }
+    return (repaired > 0) ? 1 : 0;
+}
@@ -0,0 +1,444 @@
+// lossy.c: a UDP proxy that makes the network as bad as you ask
+//
+//   lossy -l <port> -s <host:port> [impairments]
+//       sits between clients and a server: clients send to <port>, and
+//       each datagram, in either direction, may be dropped, delayed,
+//       held back so later ones overtake it, or delivered twice
+//   lossy -b [impairments] [-n <requests>] [-z <bytes>] [-t <timeout_ms>]
+//       runs a client, this proxy and an echo server in one process and
+//       reports goodput and tail latency of request/reply exchanges that
+//       retry after a fixed timeout, as the README's client does
+//
+// Impairments (each applies to every datagram, both ways):
+//   -p <percent>  loss               -d <ms>  one-way delay
+//   -u <percent>  duplication        -j <ms>  jitter, uniform in +/- ms
+//   -r <percent>  reordering         -S <n>   random seed
+//
+// The benchmark's messages are shaped like MFS_Read's: a small request and
+// a reply carrying -z bytes (4096 by default). The echo server answers
+// duplicates again, as an idempotent server would, and counts them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define MAX_CLIENTS (64)
+#define MAX_DATAGRAM (65507)   // largest UDP payload over IPv4
+
+typedef struct {
+    double loss;        // probabilities, 0..1
+    double dup;
+    double reorder;
+    long delay_us;
+    long jitter_us;
+} impair_t;
+
+// A datagram waiting for its delivery time
+typedef struct held {
+    unsigned long due;
+    int fd;
+    struct sockaddr_in to;
+    int len;
+    struct held *next;
+    char data[];
+} held_t;
+
+typedef struct {
+    struct sockaddr_in addr;
+    int fd;             // its own socket towards the server
+} client_t;
+
+typedef struct {
+    impair_t impair;
+    int listen_fd;
+    struct sockaddr_in server;
+    client_t clients[MAX_CLIENTS];
+    int nclients;
+    held_t *queue;      // by due time
+    unsigned int seed;
+    long forwarded;
+    long dropped;
+    long duplicated;
+    long reordered;
+} proxy_t;
+
+static volatile sig_atomic_t stop;
+
+void usage() {
+    fprintf(stderr, "usage: lossy -l <port> -s <host:port> [-p loss%%] [-d delay_ms] [-j jitter_ms] "
+            "[-r reorder%%] [-u dup%%] [-S seed]\n"
+            "       lossy -b [impairments] [-n requests] [-z reply_bytes] [-t timeout_ms]\n");
+    exit(1);
+}
+
+static unsigned long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int chance(proxy_t *p, double probability) {
+    return probability > 0 && rand_r(&p->seed) < probability * ((double) RAND_MAX + 1);
+}
+
+static int udp_socket(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(4);
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        perror("bind");
+        exit(4);
+    }
+    return fd;
+}
+
+static int local_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+static void parse_address(char *arg, struct sockaddr_in *addr) {
+    char host[256];
+    char *colon = strrchr(arg, ':');
+    if (colon == NULL || colon - arg >= (long) sizeof(host)) {
+        usage();
+    }
+    memcpy(host, arg, colon - arg);
+    host[colon - arg] = '\0';
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+        fprintf(stderr, "cannot resolve %s\n", arg);
+        exit(1);
+    }
+    memcpy(addr, res->ai_addr, sizeof(*addr));
+    freeaddrinfo(res);
+}
+
+// Queues one datagram for delivery, or drops it
+static void impair(proxy_t *p, int fd, struct sockaddr_in *to, char *data, int len) {
+    if (chance(p, p->impair.loss)) {
+        p->dropped++;
+        return;
+    }
+    int copies = 1;
+    if (chance(p, p->impair.dup)) {
+        copies = 2;
+        p->duplicated++;
+    }
+    for (int c = 0; c < copies; c++) {
+        long delay = p->impair.delay_us;
+        if (p->impair.jitter_us > 0) {
+            delay += rand_r(&p->seed) % (2 * p->impair.jitter_us + 1) - p->impair.jitter_us;
+        }
+        if (chance(p, p->impair.reorder)) {
+            // Long enough for anything sent right after to overtake it
+            delay += p->impair.delay_us + 2 * p->impair.jitter_us + 1000;
+            p->reordered++;
+        }
+        held_t *h = malloc(sizeof(held_t) + len);
+        if (h == NULL) {
+            p->dropped++;
+            continue;
+        }
+        h->due = now_us() + (delay > 0 ? delay : 0);
+        h->fd = fd;
+        h->to = *to;
+        h->len = len;
+        memcpy(h->data, data, len);
+        held_t **q = &p->queue;
+        while (*q != NULL && (*q)->due <= h->due) {
+            q = &(*q)->next;
+        }
+        h->next = *q;
+        *q = h;
+    }
+}
+
+static void deliver_due(proxy_t *p) {
+    unsigned long now = now_us();
+    while (p->queue != NULL && p->queue->due <= now) {
+        held_t *h = p->queue;
+        p->queue = h->next;
+        sendto(h->fd, h->data, h->len, 0, (struct sockaddr *) &h->to, sizeof(h->to));
+        p->forwarded++;
+        free(h);
+    }
+}
+
+static client_t *client_for(proxy_t *p, struct sockaddr_in *addr) {
+    for (int i = 0; i < p->nclients; i++) {
+        if (p->clients[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            p->clients[i].addr.sin_port == addr->sin_port) {
+            return &p->clients[i];
+        }
+    }
+    if (p->nclients == MAX_CLIENTS) {
+        return NULL;
+    }
+    client_t *c = &p->clients[p->nclients++];
+    c->addr = *addr;
+    c->fd = udp_socket(0);
+    return c;
+}
+
+// Forwards between clients and the server until stop is set
+static void *run_proxy(void *arg) {
+    proxy_t *p = arg;
+    static char buffer[MAX_DATAGRAM];
+    while (!stop) {
+        struct pollfd fds[MAX_CLIENTS + 1];
+        fds[0].fd = p->listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < p->nclients; i++) {
+            fds[i + 1].fd = p->clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        int timeout = 10;
+        if (p->queue != NULL) {
+            unsigned long now = now_us();
+            long wait = (p->queue->due > now) ? (long) (p->queue->due - now + 999) / 1000 : 0;
+            timeout = wait < timeout ? wait : timeout;
+        }
+        int n = p->nclients + 1;
+        if (poll(fds, n, timeout) > 0) {
+            for (int i = 0; i < n; i++) {
+                if (!(fds[i].revents & POLLIN)) {
+                    continue;
+                }
+                struct sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                int len = recvfrom(fds[i].fd, buffer, sizeof(buffer), 0, (struct sockaddr *) &from, &from_len);
+                if (len < 0) {
+                    continue;
+                }
+                if (i == 0) {
+                    client_t *c = client_for(p, &from);
+                    if (c != NULL) {
+                        impair(p, c->fd, &p->server, buffer, len);
+                    }
+                } else {
+                    impair(p, p->listen_fd, &p->clients[i - 1].addr, buffer, len);
+                }
+            }
+        }
+        deliver_due(p);
+    }
+    return NULL;
+}
+
+static void print_proxy(proxy_t *p) {
+    printf("proxy: forwarded %ld, dropped %ld, duplicated %ld, reordered %ld\n",
+           p->forwarded, p->dropped, p->duplicated, p->reordered);
+}
+
+// ---------------------------------------------------------------------------
+// Benchmark
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    unsigned int seq;
+    int reply_len;
+} bench_msg_t;
+
+static int echo_fd;
+static long echo_duplicates;
+
+// Answers every request with reply_len bytes, answering repeats again
+static void *run_echo(void *arg) {
+    static char buffer[MAX_DATAGRAM];
+    long next = 0;
+    while (!stop) {
+        struct pollfd pfd = { echo_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len = recvfrom(echo_fd, buffer, sizeof(buffer), 0, (struct sockaddr *) &from, &from_len);
+        if (len < (int) sizeof(bench_msg_t)) {
+            continue;
+        }
+        bench_msg_t *m = (bench_msg_t *) buffer;
+        if (m->seq < next) {
+            echo_duplicates++;
+        } else {
+            next = m->seq + 1;
+        }
+        int reply = sizeof(bench_msg_t) + m->reply_len;
+        sendto(echo_fd, buffer, reply <= MAX_DATAGRAM ? reply : MAX_DATAGRAM, 0,
+               (struct sockaddr *) &from, from_len);
+    }
+    return NULL;
+}
+
+static int compare_ul(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+    return (x > y) - (x < y);
+}
+
+static int run_bench(proxy_t *p, int requests, int reply_len, int timeout_ms) {
+    echo_fd = udp_socket(0);
+    p->listen_fd = udp_socket(0);
+    memset(&p->server, 0, sizeof(p->server));
+    p->server.sin_family = AF_INET;
+    p->server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    p->server.sin_port = htons(local_port(echo_fd));
+    struct sockaddr_in proxy_addr = p->server;
+    proxy_addr.sin_port = htons(local_port(p->listen_fd));
+
+    pthread_t echo_thread, proxy_thread;
+    if (pthread_create(&echo_thread, NULL, run_echo, NULL) != 0 ||
+        pthread_create(&proxy_thread, NULL, run_proxy, p) != 0) {
+        perror("pthread_create");
+        return 4;
+    }
+
+    int fd = udp_socket(0);
+    static char buffer[MAX_DATAGRAM];
+    unsigned long *latency = malloc(requests * sizeof(unsigned long));
+    long retries = 0, stale = 0;
+    unsigned long start = now_us();
+    for (int i = 0; i < requests && latency != NULL; i++) {
+        bench_msg_t req = { i, reply_len };
+        unsigned long sent = now_us();
+        int done = 0;
+        while (!done) {
+            sendto(fd, &req, sizeof(req), 0, (struct sockaddr *) &proxy_addr, sizeof(proxy_addr));
+            unsigned long deadline = now_us() + timeout_ms * 1000UL;
+            for (;;) {
+                unsigned long now = now_us();
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                if (now >= deadline || poll(&pfd, 1, (deadline - now + 999) / 1000) <= 0) {
+                    retries++;
+                    break;
+                }
+                int len = recv(fd, buffer, sizeof(buffer), 0);
+                if (len >= (int) sizeof(bench_msg_t) && ((bench_msg_t *) buffer)->seq == req.seq) {
+                    done = 1;
+                    break;
+                }
+                stale++;    // a late or duplicate reply to an earlier request
+            }
+        }
+        latency[i] = now_us() - sent;
+    }
+    double secs = (now_us() - start) / 1e6;
+    stop = 1;
+    pthread_join(proxy_thread, NULL);
+    pthread_join(echo_thread, NULL);
+    if (latency == NULL) {
+        return 4;
+    }
+
+    qsort(latency, requests, sizeof(unsigned long), compare_ul);
+    printf("loss %.1f%% delay %.1f +/- %.1f ms reorder %.1f%% dup %.1f%%, timeout %d ms\n",
+           p->impair.loss * 100, p->impair.delay_us / 1e3, p->impair.jitter_us / 1e3,
+           p->impair.reorder * 100, p->impair.dup * 100, timeout_ms);
+    printf("%d requests in %.2f s: goodput %.2f MB/s, latency p50 %.2f p99 %.2f p99.9 %.2f max %.2f ms\n",
+           requests, secs, (double) requests * reply_len / secs / 1e6,
+           latency[requests / 2] / 1e3, latency[(long) requests * 99 / 100] / 1e3,
+           latency[(long) requests * 999 / 1000] / 1e3, latency[requests - 1] / 1e3);
+    printf("retries %ld, stale replies %ld, server duplicates %ld\n", retries, stale, echo_duplicates);
+    print_proxy(p);
+    free(latency);
+    return 0;
+}
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    int port = -1, bench = 0, requests = 1000, reply_len = 4096, timeout_ms = 5000;
+    char *server = NULL;
+    proxy_t p;
+    memset(&p, 0, sizeof(p));
+    p.seed = time(NULL);
+
+    while ((ch = getopt(argc, argv, "l:s:p:d:j:r:u:S:bn:z:t:")) != -1) {
+        switch (ch) {
+        case 'l':
+            port = atoi(optarg);
+            break;
+        case 's':
+            server = optarg;
+            break;
+        case 'p':
+            p.impair.loss = atof(optarg) / 100;
+            break;
+        case 'd':
+            p.impair.delay_us = atof(optarg) * 1000;
+            break;
+        case 'j':
+            p.impair.jitter_us = atof(optarg) * 1000;
+            break;
+        case 'r':
+            p.impair.reorder = atof(optarg) / 100;
+            break;
+        case 'u':
+            p.impair.dup = atof(optarg) / 100;
+            break;
+        case 'S':
+            p.seed = atoi(optarg);
+            break;
+        case 'b':
+            bench = 1;
+            break;
+        case 'n':
+            requests = atoi(optarg);
+            break;
+        case 'z':
+            reply_len = atoi(optarg);
+            break;
+        case 't':
+            timeout_ms = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (p.impair.delay_us < 0 || p.impair.jitter_us < 0) {
+        usage();
+    }
+    if (bench) {
+        if (requests < 1 || reply_len < 0 || reply_len > MAX_DATAGRAM - (int) sizeof(bench_msg_t) ||
+            timeout_ms < 1) {
+            usage();
+        }
+        return run_bench(&p, requests, reply_len, timeout_ms);
+    }
+    if (port < 0 || server == NULL) {
+        usage();
+    }
+
+    parse_address(server, &p.server);
+    p.listen_fd = udp_socket(port);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    run_proxy(&p);
+    print_proxy(&p);
+    return 0;
+}
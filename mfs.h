@@ -1,6 +1,8 @@
 #ifndef __MFS_h__
 #define __MFS_h__
 
+#include <sys/uio.h>   // struct iovec, for MFS_ReadMap
+
 #define MFS_DIRECTORY    (0)
 #define MFS_REGULAR_FILE (1)
 
@@ -27,4 +29,85 @@ int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
 int MFS_Shutdown();
 
+// Like MFS_Unlink, but also removes a non-empty directory and everything
+// below it in a single request. 0 on success, -1 on failure.
+int MFS_RemoveTree(int pinum, char *name);
+
+// Copies file src_inum to the regular file name in dst_pinum without moving
+// the data through the client. An existing file of that name is replaced.
+// MFS_CopyRange copies only nbytes starting at offset (nbytes < 0: to the end)
+// into the start of the new file. 0 on success, -1 on failure.
+int MFS_Copy(int src_inum, int dst_pinum, char *name);
+int MFS_CopyRange(int src_inum, int dst_pinum, char *name, int offset, int nbytes);
+
+// Text report of per-operation counters, latency percentiles, image I/O and
+// free-space gauges. Returns the report length, or -1 on failure.
+int MFS_Stats(char *buffer, int nbytes);
+
+// Writes the per-thread request trace rings to path on the server as
+// Chrome trace JSON. 0 on success, -1 on failure.
+int MFS_TraceDump(char *path);
+
+// Several images can be served by one process. MFS_Mount loads an image and
+// returns its volume id (-1 on failure); MFS_Use makes it the volume the
+// calling thread's requests go to; MFS_Unmount commits and releases it. It
+// fails while another thread has it selected (a thread lets go of a volume
+// by selecting another or exiting), and returns -1 after releasing it if the
+// last commit failed. MFS_Init is MFS_Mount + MFS_Use, and MFS_Shutdown
+// unmounts the calling thread's volume, with the same result. With
+// MFS_PIN_CPUS=1, MFS_Use also pins the thread to CPU (id % number of CPUs).
+// Any number of threads may use one volume at once: lookups, stats and reads
+// run in parallel, changes one at a time, and changes committing together
+// share a sync. The replicator callback must not call back into the engine.
+int MFS_Mount(char *filename);
+int MFS_Use(int volume);
+int MFS_Unmount(int volume);
+
+// Zero-copy read: instead of copying, fills up to iovcnt entries of iov with
+// pointers into the server's read-only mapping of the image that together
+// hold the bytes MFS_Read would return. The pointers stay valid until the
+// file is next written or moved by MFS_Defrag (both recall leases on it) or
+// the volume is unmounted; hand them straight to
+// writev/sendmsg. Returns the number of entries used, 0 at end of file, or
+// -1 on failure (including too few entries).
+int MFS_ReadMap(int inum, int offset, int nbytes, struct iovec *iov, int iovcnt);
+
+// Read leases. A lease lets holder (a server-chosen client id) answer
+// MFS_Stat, MFS_Read and, on a directory, MFS_Lookup from its own cache for
+// up to seconds. Before a write, create, unlink or replace that changes a
+// leased inode is applied, the server drops the leases and calls the recall
+// function set with MFS_SetRecall once per holder, each on its own thread,
+// and waits until every call has returned or its lease has expired. The
+// function may block or call back into the engine. MFS_Lease renews an
+// existing lease.
+// All return 0 on success, -1 on failure.
+typedef void (*MFS_Recall_t)(int holder, int inum, void *arg);
+int MFS_SetRecall(MFS_Recall_t fn, void *arg);
+int MFS_Lease(int holder, int inum, int seconds);
+int MFS_Release(int holder, int inum);
+
+// Replication. On a primary, MFS_SetReplicator registers fn, which gets an
+// encoded delta for every committed change, numbered in order; send it to
+// the backups (fn must not call back into the engine on the same thread).
+// MFS_Replica(1) makes the calling thread's volume a read-only backup that
+// MFS_ApplyDelta brings forward; it returns the sequence number the backup
+// is at, or -1 if the delta is malformed, one was missed, or it comes from
+// another stream. MFS_Replica(0) promotes a backup to a writable primary. A
+// backup starts as a copy of the primary's image taken while no change was
+// in flight, before MFS_SetReplicator starts a new stream at sequence 1. A
+// primary that remounts or sets its replicator again starts another stream,
+// and its backups must be copied afresh.
+typedef void (*MFS_Replicate_t)(const char *delta, int len, void *arg);
+int MFS_SetReplicator(MFS_Replicate_t fn, void *arg);
+int MFS_Replica(int on);
+long MFS_ApplyDelta(char *delta, int len);
+
+// Defragmentation. Moves files and directories whose blocks are scattered
+// into contiguous free runs, about budget blocks per call (a file is moved
+// whole), resuming where the previous call stopped. Call it between
+// requests, e.g. from the server's idle loop, with the I/O it may spend
+// there. Returns the number of blocks moved, 0 once a full pass finds
+// nothing to move, or -1 on failure.
+long MFS_Defrag(long budget);
+
 #endif // __MFS_h__
@@ -1,35 +1,406 @@
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ufs.h"
 
+// metadata is zeroed in chunks of this many bytes (a multiple of the block size)
+#define ZERO_CHUNK (1 << 20)
+
+// imported data is staged and written in chunks of this many bytes
+#define IMPORT_CHUNK (8 << 20)
+
+#define DIR_ENTS (UFS_BLOCK_SIZE / sizeof(dir_ent_t))
+
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-j <threads>] [-p] [-r <host_dir>] [-v]\n");
     exit(1);
 }
 
+// block and inode counts are ints in the super block
+int parse_count(char *arg) {
+    char *end;
+    long n = strtol(arg, &end, 10);
+    if (*end != '\0' || n <= 0 || n > INT_MAX) {
+	fprintf(stderr, "mkfs: bad count '%s'\n", arg);
+	exit(1);
+    }
+    return n;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    int fd;
+    off_t start; // byte range [start, end) to zero
+    off_t end;
+    unsigned char *zeros;
+    int rc;
+} zero_job_t;
+
+void *zero_range(void *arg) {
+    zero_job_t *job = arg;
+    off_t off;
+    for (off = job->start; off < job->end; off += ZERO_CHUNK) {
+	size_t len = (job->end - off < ZERO_CHUNK) ? (size_t) (job->end - off) : ZERO_CHUNK;
+	if (pwrite(job->fd, job->zeros, len, off) != (ssize_t) len) {
+	    job->rc = -1;
+	    return NULL;
+	}
+    }
+    job->rc = 0;
+    return NULL;
+}
+
+// zero [start, end) with large writes, split across num_threads threads
+int zero_region(int fd, off_t start, off_t end, int num_threads) {
+    unsigned char *zeros;
+    if (posix_memalign((void **) &zeros, UFS_BLOCK_SIZE, ZERO_CHUNK) != 0)
+	return -1;
+    memset(zeros, 0, ZERO_CHUNK);
+
+    // split on chunk boundaries so every thread issues full, aligned writes
+    off_t chunks = (end - start + ZERO_CHUNK - 1) / ZERO_CHUNK;
+    if (num_threads > chunks)
+	num_threads = (chunks > 0) ? chunks : 1;
+
+    zero_job_t *jobs = calloc(num_threads, sizeof(zero_job_t));
+    pthread_t *tids = calloc(num_threads, sizeof(pthread_t));
+    assert(jobs != NULL && tids != NULL);
+
+    int i, rc = 0;
+    for (i = 0; i < num_threads; i++) {
+	jobs[i].fd = fd;
+	jobs[i].zeros = zeros;
+	jobs[i].start = start + (chunks * i / num_threads) * ZERO_CHUNK;
+	jobs[i].end = start + (chunks * (i + 1) / num_threads) * ZERO_CHUNK;
+	if (jobs[i].end > end)
+	    jobs[i].end = end;
+	if (num_threads == 1 || pthread_create(&tids[i], NULL, zero_range, &jobs[i]) != 0) {
+	    zero_range(&jobs[i]);
+	    tids[i] = 0;
+	}
+    }
+    for (i = 0; i < num_threads; i++) {
+	if (tids[i] != 0)
+	    pthread_join(tids[i], NULL);
+	if (jobs[i].rc != 0)
+	    rc = -1;
+    }
+
+    free(jobs);
+    free(tids);
+    free(zeros);
+    return rc;
+}
+
+//
+// bulk import (-r): copy a host directory tree into the fresh image in one
+// pass. Inodes and data blocks are handed out strictly in order, so both
+// bitmaps end up as a prefix of set bits and the data region is produced as
+// one sequential stream of large writes. Directories are walked breadth
+// first: a directory's entries (and so its children's inode numbers) are
+// fixed when it is visited, its blocks are emitted, then its files' data;
+// subdirectories are emitted later when their turn comes.
+//
+typedef struct {
+    char *path;
+    int inum;
+    int pinum;
+} import_dir_t;
+
+typedef struct {
+    int fd;
+    super_t *s;
+    inode_t *inodes;
+    int next_inum;
+    int next_block;          // next free data block (relative to the data region)
+    unsigned char *stage;    // staged blocks, starting at data block stage_first
+    int stage_first;
+    int stage_blocks;
+    import_dir_t *queue;
+    int queue_len;
+    int queue_cap;
+    int files, dirs, skipped;
+} import_t;
+
+int import_flush(import_t *im) {
+    size_t len = (size_t) im->stage_blocks * UFS_BLOCK_SIZE;
+    off_t off = (off_t) (im->s->data_region_addr + im->stage_first) * UFS_BLOCK_SIZE;
+    if (len > 0 && pwrite(im->fd, im->stage, len, off) != (ssize_t) len)
+	return -1;
+    im->stage_first += im->stage_blocks;
+    im->stage_blocks = 0;
+    return 0;
+}
+
+// hand out the next data block; returns a zeroed staging slot for its contents
+unsigned char *import_block(import_t *im, unsigned int *addr) {
+    if (im->next_block >= im->s->num_data) {
+	fprintf(stderr, "mkfs: out of data blocks (use a larger -d)\n");
+	return NULL;
+    }
+    if (im->stage_blocks == IMPORT_CHUNK / UFS_BLOCK_SIZE && import_flush(im) != 0) {
+	perror("write");
+	return NULL;
+    }
+    *addr = im->s->data_region_addr + im->next_block++;
+    unsigned char *slot = im->stage + (size_t) im->stage_blocks++ * UFS_BLOCK_SIZE;
+    memset(slot, 0, UFS_BLOCK_SIZE);
+    return slot;
+}
+
+int import_inode(import_t *im, int type) {
+    if (im->next_inum >= im->s->num_inodes) {
+	fprintf(stderr, "mkfs: out of inodes (use a larger -i)\n");
+	return -1;
+    }
+    int inum = im->next_inum++;
+    im->inodes[inum].type = type;
+    im->inodes[inum].size = 0;
+    int i;
+    for (i = 0; i < DIRECT_PTRS; i++)
+	im->inodes[inum].direct[i] = -1;
+    return inum;
+}
+
+int import_file(import_t *im, char *path, int inum) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+	perror(path);
+	if (fd >= 0)
+	    close(fd);
+	return -1;
+    }
+    if (st.st_size > (off_t) DIRECT_PTRS * UFS_BLOCK_SIZE) {
+	fprintf(stderr, "mkfs: %s: larger than %d blocks\n", path, DIRECT_PTRS);
+	close(fd);
+	return -1;
+    }
+    inode_t *ip = &im->inodes[inum];
+    int nblocks = (st.st_size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    int i;
+    for (i = 0; i < nblocks; i++) {
+	unsigned char *slot = import_block(im, &ip->direct[i]);
+	if (slot == NULL) {
+	    close(fd);
+	    return -1;
+	}
+	// read straight into the staging buffer; a file that shrank under us
+	// is zero-filled to the size we recorded
+	ssize_t want = (st.st_size - (off_t) i * UFS_BLOCK_SIZE < UFS_BLOCK_SIZE) ?
+	    st.st_size - (off_t) i * UFS_BLOCK_SIZE : UFS_BLOCK_SIZE;
+	ssize_t got = 0, n;
+	while (got < want && (n = read(fd, slot + got, want - got)) > 0)
+	    got += n;
+    }
+    ip->size = st.st_size;
+    close(fd);
+    im->files++;
+    return 0;
+}
+
+int skip_dots(const struct dirent *d) {
+    return strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0;
+}
+
+int import_dir(import_t *im, import_dir_t *dir) {
+    struct dirent **names;
+    int n = scandir(dir->path, &names, skip_dots, alphasort);
+    if (n < 0) {
+	perror(dir->path);
+	return -1;
+    }
+    if (n + 2 > DIRECT_PTRS * (int) DIR_ENTS) {
+	fprintf(stderr, "mkfs: %s: more than %d entries\n", dir->path, DIRECT_PTRS * (int) DIR_ENTS - 2);
+	return -1;
+    }
+
+    // decide the children (and their inode numbers) first
+    dir_ent_t *ents = calloc(n + 2, sizeof(dir_ent_t));
+    int *types = calloc(n + 2, sizeof(int));
+    char **paths = calloc(n + 2, sizeof(char *));
+    assert(ents != NULL && types != NULL && paths != NULL);
+    strcpy(ents[0].name, ".");
+    ents[0].inum = dir->inum;
+    strcpy(ents[1].name, "..");
+    ents[1].inum = dir->pinum;
+    int count = 2, i, rc = 0;
+    for (i = 0; i < n; i++) {
+	char *name = names[i]->d_name;
+	struct stat st;
+	char *path = malloc(strlen(dir->path) + strlen(name) + 2);
+	assert(path != NULL);
+	sprintf(path, "%s/%s", dir->path, name);
+	if (strlen(name) >= sizeof(ents[0].name)) {
+	    fprintf(stderr, "mkfs: %s: name longer than %lu bytes\n", path, sizeof(ents[0].name) - 1);
+	    rc = -1;
+	} else if (lstat(path, &st) != 0) {
+	    perror(path);
+	    rc = -1;
+	} else if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+	    fprintf(stderr, "mkfs: %s: not a file or directory, skipped\n", path);
+	    im->skipped++;
+	} else {
+	    types[count] = S_ISDIR(st.st_mode) ? UFS_DIRECTORY : UFS_REGULAR_FILE;
+	    ents[count].inum = import_inode(im, types[count]);
+	    if (ents[count].inum < 0)
+		rc = -1;
+	    strcpy(ents[count].name, name);
+	    paths[count++] = path;
+	    path = NULL;
+	}
+	free(path);
+	free(names[i]);
+	if (rc != 0)
+	    break;
+    }
+    for (i++; i < n; i++)
+	free(names[i]);
+    free(names);
+
+    // the directory's own blocks, entries packed from slot 0
+    inode_t *ip = &im->inodes[dir->inum];
+    int b;
+    for (b = 0; rc == 0 && b * (int) DIR_ENTS < count; b++) {
+	dir_ent_t *blk = (dir_ent_t *) import_block(im, &ip->direct[b]);
+	if (blk == NULL) {
+	    rc = -1;
+	    break;
+	}
+	for (i = 0; i < (int) DIR_ENTS; i++) {
+	    if (b * (int) DIR_ENTS + i < count)
+		blk[i] = ents[b * DIR_ENTS + i];
+	    else
+		blk[i].inum = -1;
+	}
+    }
+    ip->size = count * sizeof(dir_ent_t);
+    im->dirs++;
+
+    // then its files' data; subdirectories wait for their turn in the queue
+    for (i = 2; i < count; i++) {
+	if (rc == 0 && types[i] == UFS_REGULAR_FILE) {
+	    rc = import_file(im, paths[i], ents[i].inum);
+	} else if (rc == 0) {
+	    if (im->queue_len == im->queue_cap) {
+		im->queue_cap *= 2;
+		im->queue = realloc(im->queue, im->queue_cap * sizeof(import_dir_t));
+		assert(im->queue != NULL);
+	    }
+	    im->queue[im->queue_len].path = paths[i];
+	    im->queue[im->queue_len].inum = ents[i].inum;
+	    im->queue[im->queue_len].pinum = dir->inum;
+	    im->queue_len++;
+	    paths[i] = NULL;
+	}
+	free(paths[i]);
+    }
+    free(ents);
+    free(types);
+    free(paths);
+    return rc;
+}
+
+// populate the image from host_dir; the metadata region (both bitmaps and
+// the inode table) is built in memory and written with a single pwrite
+int import_tree(int fd, super_t *s, char *host_dir) {
+    import_t im;
+    memset(&im, 0, sizeof(im));
+    im.fd = fd;
+    im.s = s;
+    size_t meta_len = (size_t) (s->data_region_addr - 1) * UFS_BLOCK_SIZE;
+    unsigned char *meta = calloc(1, meta_len);
+    if (meta == NULL || posix_memalign((void **) &im.stage, UFS_BLOCK_SIZE, IMPORT_CHUNK) != 0)
+	return -1;
+    im.inodes = (inode_t *) (meta + (size_t) (s->inode_region_addr - 1) * UFS_BLOCK_SIZE);
+    im.queue_cap = 64;
+    im.queue = malloc(im.queue_cap * sizeof(import_dir_t));
+    assert(im.queue != NULL);
+    im.queue[im.queue_len].path = strdup(host_dir);
+    im.queue[im.queue_len].inum = import_inode(&im, UFS_DIRECTORY);
+    im.queue[im.queue_len].pinum = 0;
+    im.queue_len++;
+
+    int rc = 0, next;
+    for (next = 0; next < im.queue_len; next++) {
+	if (rc == 0)
+	    rc = import_dir(&im, &im.queue[next]);
+	free(im.queue[next].path);
+    }
+    if (rc == 0 && import_flush(&im) != 0) {
+	perror("write");
+	rc = -1;
+    }
+
+    // everything was allocated in order, so each bitmap is a run of ones
+    if (rc == 0) {
+	unsigned int *ibits = (unsigned int *) (meta + (size_t) (s->inode_bitmap_addr - 1) * UFS_BLOCK_SIZE);
+	unsigned int *dbits = (unsigned int *) (meta + (size_t) (s->data_bitmap_addr - 1) * UFS_BLOCK_SIZE);
+	int i;
+	for (i = 0; i < im.next_inum; i++)
+	    ibits[i / 32] |= 0x1u << (31 - i % 32);
+	for (i = 0; i < im.next_block; i++)
+	    dbits[i / 32] |= 0x1u << (31 - i % 32);
+	if (pwrite(fd, meta, meta_len, UFS_BLOCK_SIZE) != (ssize_t) meta_len) {
+	    perror("write");
+	    rc = -1;
+	}
+    }
+    if (rc == 0)
+	printf("imported            %d files, %d directories, %d data blocks (%d skipped)\n",
+	       im.files, im.dirs, im.next_block, im.skipped);
+
+    free(im.queue);
+    free(im.stage);
+    free(meta);
+    return rc;
+}
+
 int main(int argc, char *argv[]) {
     int ch;
     char *image_file = NULL;
     int num_inodes = 32;
     int num_data = 32;
+    int num_threads = 1;
+    int preallocate = 0;
     int visual = 0;
+    char *host_dir = NULL;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:j:pr:v")) != -1) {
 	switch (ch) {
 	case 'i':
-	    num_inodes = atoi(optarg);
+	    num_inodes = parse_count(optarg);
 	    break;
 	case 'd':
-	    num_data = atoi(optarg);
+	    num_data = parse_count(optarg);
 	    break;
 	case 'f':
 	    image_file = optarg;
 	    break;
+	case 'j':
+	    num_threads = atoi(optarg);
+	    break;
+	case 'p':
+	    preallocate = 1;
+	    break;
+	case 'r':
+	    host_dir = optarg;
+	    break;
 	case 'v':
 	    visual = 1;
 	    break;
@@ -40,15 +411,10 @@ int main(int argc, char *argv[]) {
     argc -= optind;
     argv += optind;
 
-    if (image_file == NULL)
+    if (image_file == NULL || num_threads < 1)
 	usage();
 
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
-	exit(1);
-    }
+    double start_time = now();
 
     int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
@@ -56,6 +422,11 @@ int main(int argc, char *argv[]) {
 	exit(1);
     }
 
+    // changes tracked for the old contents mean nothing for the new ones
+    char cbt_file[PATH_MAX];
+    snprintf(cbt_file, sizeof(cbt_file), "%s.cbt", image_file);
+    unlink(cbt_file);
+
     assert(num_inodes >= 32);
     assert(num_data >= 32);
 
@@ -82,7 +453,7 @@ int main(int argc, char *argv[]) {
 
     // inode table
     s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
-    int total_inode_bytes = num_inodes * sizeof(inode_t);
+    off_t total_inode_bytes = (off_t) num_inodes * sizeof(inode_t);
     s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
     if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
 	s.inode_region_len++;
@@ -91,7 +462,13 @@ int main(int argc, char *argv[]) {
     s.data_region_addr = s.inode_region_addr + s.inode_region_len;
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    // every block address (and the inodes' direct pointers) must fit in an int
+    long total = 1L + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    if (total > INT_MAX) {
+	fprintf(stderr, "mkfs: %ld blocks is more than an image can address\n", total);
+	exit(1);
+    }
+    int total_blocks = total;
 
     // super block is the first block
     int rc = pwrite(fd, &s, sizeof(super_t), 0);
@@ -107,16 +484,31 @@ int main(int argc, char *argv[]) {
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
 
-    // first, zero out all the blocks
-    int i;
-    for (i = 1; i < total_blocks; i++) {
-	rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-	if (rc != UFS_BLOCK_SIZE) {
-	    perror("write");
+    // size the image up front; the data region is left as a hole (it never
+    // needs zeroing: blocks are written before they are read), unless -p
+    // asks for it to be preallocated
+    off_t image_size = (off_t) total_blocks * UFS_BLOCK_SIZE;
+    if (ftruncate(fd, image_size) != 0) {
+	perror("ftruncate");
+	exit(1);
+    }
+    off_t data_start = (off_t) s.data_region_addr * UFS_BLOCK_SIZE;
+    if (preallocate) {
+	rc = posix_fallocate(fd, data_start, image_size - data_start);
+	if (rc != 0) {
+	    fprintf(stderr, "fallocate: %s\n", strerror(rc));
 	    exit(1);
 	}
     }
 
+    // then zero out the metadata (bitmaps and inode table) so it is really on disk
+    if (zero_region(fd, UFS_BLOCK_SIZE, data_start, num_threads) != 0) {
+	perror("write");
+	exit(1);
+    }
+
+    int i;
+
     //
     // need to allocate first inode in inode bitmap
     //
@@ -130,14 +522,14 @@ int main(int argc, char *argv[]) {
 	b.bits[i] = 0;
     b.bits[0] = 0x1 << 31; // first entry is allocated
     
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, (off_t) s.inode_bitmap_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
     //
     // need to allocate first data block in data bitmap
     // (can just reuse this to write out data bitmap too)
     //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, (off_t) s.data_bitmap_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
     //
@@ -148,13 +540,14 @@ int main(int argc, char *argv[]) {
     } inode_block;
 
     inode_block itable;
+    memset(&itable, 0, sizeof(itable));
     itable.inodes[0].type = UFS_DIRECTORY;
     itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
     itable.inodes[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
 	itable.inodes[0].direct[i] = -1;
 
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, (off_t) s.inode_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
     // 
@@ -177,9 +570,15 @@ int main(int argc, char *argv[]) {
     for (i = 2; i < 128; i++)
 	parent.entries[i].inum = -1;
 
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, (off_t) s.data_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
+    // -r: replace the empty root with a copy of a host directory tree
+    if (host_dir != NULL && import_tree(fd, &s, host_dir) != 0) {
+	fprintf(stderr, "mkfs: import of %s failed\n", host_dir);
+	exit(1);
+    }
+
     if (visual) {
 	int i;
 	printf("\nVisualization of layout\n\n");
@@ -197,6 +596,8 @@ int main(int argc, char *argv[]) {
 
     (void) fsync(fd);
     (void) close(fd);
+
+    printf("formatted in        %.3f s\n", now() - start_time);
     
     return 0;
 }
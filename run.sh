@@ -1,3 +1,3 @@
 #!/bin/bash
-gcc filemgr2.c -o filemgr
+gcc -pthread filemgr2.c -o filemgr
 ./filemgr filesystem
\ No newline at end of file
@@ -33,5 +33,16 @@ typedef struct __super {
     int num_data;          // and data blocks...
 } super_t;
 
+// Changed-block tracking sidecar (<image>.cbt): this header, alone in the
+// first block, then one bit per image block (most significant bit first, as
+// in the bitmaps), set once the block changes after epoch began
+#define UFS_CBT_MAGIC (0x4d465343)
+
+typedef struct {
+    unsigned int magic;
+    int nblocks;           // image size in blocks
+    unsigned long epoch;   // backups taken so far
+} cbt_header_t;
+
 
 #endif // __ufs_h__